@@ -0,0 +1,212 @@
+#include "arena.h"
+#include <assert.h>
+
+// Size of the first chunk allocated by an arena. Each later chunk doubles in
+// size up to `MAX_CHUNK_SIZE`, so small maps stay small while large ones make
+// few allocations.
+#define MIN_CHUNK_SIZE 4096
+#define MAX_CHUNK_SIZE (1 << 20)
+
+// Chunks are kept in a singly linked list, and are only freed when the arena
+// is destroyed.
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+};
+
+// Large blocks are kept in a doubly linked list so that they can be freed
+// individually, as well as all at once when the arena is destroyed.
+struct arena_large {
+  struct arena_large *prev;
+  struct arena_large *next;
+  size_t size;
+};
+
+// Freed small blocks are linked through their first word.
+struct arena_free {
+  struct arena_free *next;
+};
+
+// Internal helper functions. Implemented at the bottom of this file.
+static size_t round_up(size_t size);
+static void add_chunk(struct arena *a, size_t size);
+
+/**
+ * Initialize an empty arena that gets its memory from `allocator`, which must
+ * outlive it. No memory is allocated until the first call to `arena_alloc`.
+ */
+void arena_init(struct arena *a, const struct map_allocator *allocator) {
+  a->allocator = allocator;
+  a->chunks = NULL;
+  a->chunk_size = MIN_CHUNK_SIZE;
+  a->next = NULL;
+  a->end = NULL;
+  for (int i = 0; i < ARENA_CLASSES; i += 1) {
+    a->free_lists[i] = NULL;
+  }
+  a->large = NULL;
+  a->held = 0;
+  a->used = 0;
+}
+
+/**
+ * Free all memory held by an arena, including every block that has not been
+ * returned with `arena_free`.
+ */
+void arena_destroy(struct arena *a) {
+  const struct map_allocator *al = a->allocator;
+  while (a->chunks != NULL) {
+    struct arena_chunk *next = a->chunks->next;
+    al->free(al->ctx, a->chunks, a->chunks->size);
+    a->chunks = next;
+  }
+  while (a->large != NULL) {
+    struct arena_large *next = a->large->next;
+    size_t size = sizeof (struct arena_large) + a->large->size;
+    al->free(al->ctx, a->large, size);
+    a->large = next;
+  }
+}
+
+/**
+ * Allocate a block of at least `size` bytes from an arena.
+ */
+void *arena_alloc(struct arena *a, size_t size) {
+  size = round_up(size);
+
+  // Large blocks get an allocation of their own, with a header linking them
+  // into the arena.
+  if (size > ARENA_MAX_SMALL) {
+    const struct map_allocator *al = a->allocator;
+    struct arena_large *large =
+        al->alloc(al->ctx, sizeof (struct arena_large) + size);
+    assert(large != NULL);
+    large->size = size;
+    large->prev = NULL;
+    large->next = a->large;
+    if (a->large != NULL) a->large->prev = large;
+    a->large = large;
+    return large + 1;
+  }
+
+  // Prefer reusing a freed block of the same size class.
+  a->used += size;
+  struct arena_free **list = &a->free_lists[size / ARENA_ALIGN - 1];
+  if (*list != NULL) {
+    struct arena_free *block = *list;
+    *list = block->next;
+    return block;
+  }
+
+  // Otherwise, bump-allocate from the current chunk.
+  if ((size_t) (a->end - a->next) < size) {
+    add_chunk(a, a->chunk_size);
+    if (a->chunk_size < MAX_CHUNK_SIZE) {
+      a->chunk_size *= 2;
+    }
+  }
+  void *block = a->next;
+  a->next += size;
+  return block;
+}
+
+/**
+ * Make sure that the next `size` bytes of small blocks allocated from an arena
+ * can be carved from a single contiguous chunk. Blocks taken from free lists
+ * do not count towards this.
+ */
+void arena_reserve(struct arena *a, size_t size) {
+  if ((size_t) (a->end - a->next) < size) {
+    add_chunk(a, sizeof (struct arena_chunk) + size);
+  }
+}
+
+/**
+ * Determine whether less than half of the memory an arena holds in chunks is
+ * taken up by small blocks in use, so that copying them into a new arena would
+ * give most of it back.
+ */
+bool arena_is_sparse(const struct arena *a) {
+  return a->used < a->held / 2;
+}
+
+/**
+ * Initialize an empty arena to take over the blocks in use from `from`. The
+ * new arena holds a single chunk with room for every small block in use, and
+ * takes over all of the large blocks, which keep their addresses. The owner
+ * must then copy each small block in use across with `arena_alloc` before
+ * destroying `from`.
+ */
+void arena_init_compacted(struct arena *a, struct arena *from) {
+  arena_init(a, from->allocator);
+  if (from->used > 0) {
+    arena_reserve(a, from->used);
+  }
+  a->large = from->large;
+  from->large = NULL;
+}
+
+/**
+ * Get the number of bytes an arena sets aside for a block of `size` bytes.
+ * Blocks of more than `ARENA_MAX_SMALL` bytes by this measure are allocated on
+ * their own rather than carved from chunks.
+ */
+size_t arena_block_size(size_t size) {
+  return round_up(size);
+}
+
+/**
+ * Return a block to an arena. The `size` must match the size passed to
+ * `arena_alloc` when the block was allocated.
+ */
+void arena_free(struct arena *a, void *block, size_t size) {
+  size = round_up(size);
+
+  if (size > ARENA_MAX_SMALL) {
+    struct arena_large *large = (struct arena_large *) block - 1;
+    if (large->prev != NULL) {
+      large->prev->next = large->next;
+    } else {
+      a->large = large->next;
+    }
+    if (large->next != NULL) large->next->prev = large->prev;
+    const struct map_allocator *al = a->allocator;
+    al->free(al->ctx, large, sizeof (struct arena_large) + size);
+    return;
+  }
+
+  a->used -= size;
+  struct arena_free **list = &a->free_lists[size / ARENA_ALIGN - 1];
+  struct arena_free *freed = block;
+  freed->next = *list;
+  *list = freed;
+}
+
+/**
+ * Internal helper; round a block size up to a nonzero multiple of
+ * `ARENA_ALIGN`.
+ */
+static size_t round_up(size_t size) {
+  if (size == 0) size = 1;
+  return (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+/**
+ * Internal helper; start bump-allocating from a new chunk of `size` bytes.
+ * Whatever remains of the current chunk is abandoned, which wastes less than
+ * `ARENA_MAX_SMALL` bytes when called from `arena_alloc`.
+ */
+static void add_chunk(struct arena *a, size_t size) {
+  const struct map_allocator *al = a->allocator;
+  struct arena_chunk *chunk = al->alloc(al->ctx, size);
+  assert(chunk != NULL);
+  chunk->next = a->chunks;
+  chunk->size = size;
+  a->chunks = chunk;
+  a->held += size;
+
+  // The chunk header is a multiple of `ARENA_ALIGN` bytes, so the usable space
+  // that follows it stays aligned.
+  a->next = (char *) (chunk + 1);
+  a->end = (char *) chunk + size;
+}
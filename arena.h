@@ -0,0 +1,99 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "map.h"
+
+/**
+ * Memory arena used by the map to store its entries.
+ * 
+ * Small blocks are carved out of large chunks by bumping a pointer, with no
+ * per-block header. Freed small blocks are kept on a free list for their size
+ * class and reused by later allocations of the same class. Blocks larger than
+ * `ARENA_MAX_SMALL` bytes are allocated individually. Destroying an arena frees
+ * every block it handed out at once, without visiting them. All memory comes
+ * from the map's allocator.
+ * 
+ * Chunks are only freed when the arena is destroyed. To give back chunks that
+ * have become mostly free, the owner copies its live blocks into a new arena
+ * (see `arena_init_compacted`) and destroys the old one.
+ * 
+ * This header is internal to the map implementation.
+ */
+
+// Blocks are sized in multiples of `ARENA_ALIGN` bytes, and aligned to it.
+#define ARENA_ALIGN 8
+
+// Largest block size served from chunks; larger blocks are allocated on their
+// own.
+#define ARENA_MAX_SMALL 256
+
+#define ARENA_CLASSES (ARENA_MAX_SMALL / ARENA_ALIGN)
+
+struct arena {
+  const struct map_allocator *allocator;
+  struct arena_chunk *chunks;
+  size_t chunk_size;
+  char *next;
+  char *end;
+  struct arena_free *free_lists[ARENA_CLASSES];
+  struct arena_large *large;
+  size_t held;
+  size_t used;
+};
+
+/**
+ * Initialize an empty arena that gets its memory from `allocator`, which must
+ * outlive it. No memory is allocated until the first call to `arena_alloc`.
+ */
+void arena_init(struct arena *a, const struct map_allocator *allocator);
+
+/**
+ * Free all memory held by an arena, including every block that has not been
+ * returned with `arena_free`.
+ */
+void arena_destroy(struct arena *a);
+
+/**
+ * Allocate a block of at least `size` bytes from an arena.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+ * Make sure that the next `size` bytes of small blocks allocated from an arena
+ * can be carved from a single contiguous chunk. Blocks taken from free lists
+ * do not count towards this.
+ */
+void arena_reserve(struct arena *a, size_t size);
+
+/**
+ * Determine whether less than half of the memory an arena holds in chunks is
+ * taken up by small blocks in use, so that copying them into a new arena would
+ * give most of it back.
+ */
+bool arena_is_sparse(const struct arena *a);
+
+/**
+ * Initialize an empty arena to take over the blocks in use from `from`. The
+ * new arena holds a single chunk with room for every small block in use, and
+ * takes over all of the large blocks, which keep their addresses. The owner
+ * must then copy each small block in use across with `arena_alloc` before
+ * destroying `from`.
+ */
+void arena_init_compacted(struct arena *a, struct arena *from);
+
+/**
+ * Get the number of bytes an arena sets aside for a block of `size` bytes.
+ * Blocks of more than `ARENA_MAX_SMALL` bytes by this measure are allocated on
+ * their own rather than carved from chunks.
+ */
+size_t arena_block_size(size_t size);
+
+/**
+ * Return a block to an arena. The `size` must match the size passed to
+ * `arena_alloc` when the block was allocated.
+ */
+void arena_free(struct arena *a, void *block, size_t size);
+
+#endif
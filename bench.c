@@ -0,0 +1,589 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "map.h"
+#include "hash.h"
+
+/**
+ * Benchmarks for the map implementation.
+ *
+ * Usage: ./bench [n]
+ *
+ * Compares the quality and throughput of the available string hashes, then
+ * builds a map of `n` keys (default 1M) and reports the average cost of the
+ * core operations in nanoseconds, followed by the tail latency of insertions,
+ * the memory and lookup cost of each maximum load factor, and the savings from
+ * sharing keys between maps through a pool or borrowing them from the caller.
+ */
+
+// The hash functions from `hash.h`, for comparison against each other.
+struct hash_fn {
+  const char *name;
+  uint64_t (*fn)(const char *key, size_t len, uint64_t seed);
+};
+static const struct hash_fn hash_fns[] = {
+  {"hash_legacy", hash_legacy},
+  {"hash_wy", hash_wy},
+};
+#define NUM_HASH_FNS (int) (sizeof hash_fns / sizeof hash_fns[0])
+
+/**
+ * Get the current time, in seconds, from a monotonic clock.
+ */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Shuffle an array of `n` keys in place.
+ */
+static void shuffle(char **keys, int n) {
+  for (int i = n - 1; i > 0; i -= 1) {
+    int j = rand() % (i + 1);
+    char *tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+/**
+ * Generate `n` distinct keys starting with `prefix`. The returned array and
+ * its strings must be freed with `free_keys`.
+ */
+static char **make_keys(int n, const char *prefix) {
+  char **keys = malloc(n * sizeof (char *));
+  for (int i = 0; i < n; i += 1) {
+    char buf[64];
+    snprintf(buf, sizeof buf, "%s:%d", prefix, i);
+    keys[i] = strdup(buf);
+  }
+
+  // Shuffle, so that lookups do not visit the keys in the order they were
+  // allocated.
+  shuffle(keys, n);
+  return keys;
+}
+
+/**
+ * Generate `n` distinct URL-like keys between 60 and 200 bytes long, in the
+ * same format as `make_keys`.
+ */
+static char **make_url_keys(int n) {
+  static const char *words[] = {
+    "api", "v2", "users", "orders", "search", "static", "images", "items",
+    "account", "settings", "checkout", "catalog", "reviews", "session",
+  };
+  char **keys = malloc(n * sizeof (char *));
+  for (int i = 0; i < n; i += 1) {
+    char buf[256];
+    int len = snprintf(buf, sizeof buf, "https://www.example.com");
+    int target = 60 + rand() % 120;
+    while (len < target) {
+      len += snprintf(buf + len, sizeof buf - len, "/%s", words[rand() % 14]);
+    }
+    snprintf(buf + len, sizeof buf - len, "?id=%d", i);
+    keys[i] = strdup(buf);
+  }
+  return keys;
+}
+
+/**
+ * Free keys created with `make_keys` or `make_url_keys`.
+ */
+static void free_keys(char **keys, int n) {
+  for (int i = 0; i < n; i += 1) {
+    free(keys[i]);
+  }
+  free(keys);
+}
+
+/**
+ * Print one result line, given the elapsed time for `n` operations.
+ */
+static void report(const char *name, double elapsed, int n) {
+  printf("  %-24s %8.1f ns/op\n", name, elapsed * 1e9 / n);
+}
+
+/**
+ * Internal helper for `qsort`; compare two hashes.
+ */
+static int compare_hashes(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Measure the quality of each hash function over a set of keys:
+ * 
+ * - `collisions`: pairs of distinct keys with equal 64-bit hashes.
+ * - `chi2/df`: uniformity of the low 16 bits, which select a map slot; values
+ *   near 1.0 are expected for a uniform hash.
+ * - `avalanche`: the largest deviation, over all output bits, from a 50%
+ *   chance of flipping when a single input bit is flipped; lower is better.
+ */
+static void bench_hash_quality(char **keys, int n) {
+  uint64_t *hashes = malloc(n * sizeof (uint64_t));
+  int *buckets = malloc((1 << 16) * sizeof (int));
+
+  for (int f = 0; f < NUM_HASH_FNS; f += 1) {
+    for (int i = 0; i < n; i += 1) {
+      hashes[i] = hash_fns[f].fn(keys[i], strlen(keys[i]), 0);
+    }
+
+    // Count full-hash collisions by sorting and looking for adjacent repeats.
+    memset(buckets, 0, (1 << 16) * sizeof (int));
+    for (int i = 0; i < n; i += 1) {
+      buckets[hashes[i] & 0xffff] += 1;
+    }
+    qsort(hashes, n, sizeof (uint64_t), compare_hashes);
+    int collisions = 0;
+    for (int i = 1; i < n; i += 1) {
+      collisions += hashes[i] == hashes[i - 1];
+    }
+
+    double expected = (double) n / (1 << 16);
+    double chi2 = 0;
+    for (int b = 0; b < 1 << 16; b += 1) {
+      chi2 += (buckets[b] - expected) * (buckets[b] - expected) / expected;
+    }
+
+    // Flip each bit of a sample of keys, and track how often each output bit
+    // changes as a result.
+    int flips[64] = {0};
+    int trials = 0;
+    for (int i = 0; i < n && i < 2000; i += 1) {
+      char buf[256];
+      size_t len = strlen(keys[i]);
+      memcpy(buf, keys[i], len);
+      uint64_t base = hash_fns[f].fn(buf, len, 0);
+      for (size_t bit = 0; bit < len * 8; bit += 1) {
+        buf[bit / 8] ^= 1 << (bit % 8);
+        uint64_t diff = base ^ hash_fns[f].fn(buf, len, 0);
+        buf[bit / 8] ^= 1 << (bit % 8);
+        for (int o = 0; o < 64; o += 1) {
+          flips[o] += (diff >> o) & 1;
+        }
+        trials += 1;
+      }
+    }
+    double bias = 0;
+    for (int o = 0; o < 64; o += 1) {
+      double d = (double) flips[o] / trials - 0.5;
+      if (d < 0) d = -d;
+      if (d > bias) bias = d;
+    }
+
+    printf("  %-12s collisions %-6d chi2/df %-6.3f avalanche %.4f\n",
+        hash_fns[f].name, collisions, chi2 / ((1 << 16) - 1), bias);
+  }
+
+  free(hashes);
+  free(buckets);
+}
+
+/**
+ * Measure the throughput of each hash function over a set of keys.
+ */
+static void bench_hash_speed(char **keys, int n) {
+
+  // Pack the keys back to back, so that the measurement is not dominated by
+  // cache misses on scattered key strings.
+  size_t *lens = malloc(n * sizeof (size_t));
+  size_t bytes = 0;
+  for (int i = 0; i < n; i += 1) {
+    lens[i] = strlen(keys[i]);
+    bytes += lens[i];
+  }
+  char *packed = malloc(bytes);
+  size_t offset = 0;
+  for (int i = 0; i < n; i += 1) {
+    memcpy(packed + offset, keys[i], lens[i]);
+    offset += lens[i];
+  }
+
+  for (int f = 0; f < NUM_HASH_FNS; f += 1) {
+    uint64_t sink = 0;
+    double start = now();
+    for (int r = 0; r < 4; r += 1) {
+      offset = 0;
+      for (int i = 0; i < n; i += 1) {
+        sink += hash_fns[f].fn(packed + offset, lens[i], 0);
+        offset += lens[i];
+      }
+    }
+    double elapsed = now() - start;
+    printf("  %-12s %8.1f ns/key %8.2f GB/s\n", hash_fns[f].name,
+        elapsed * 1e9 / (4.0 * n), 4.0 * bytes / elapsed / 1e9);
+    if (sink == 1) printf("\n");
+  }
+
+  free(packed);
+  free(lens);
+}
+
+/**
+ * Compare the available hash functions on short and long keys.
+ */
+static void bench_hash(int n) {
+  char **keys = make_keys(n, "key");
+  char **urls = make_url_keys(n);
+
+  printf("hash quality, short keys (n = %d)\n", n);
+  bench_hash_quality(keys, n);
+  printf("hash quality, url keys (n = %d)\n", n);
+  bench_hash_quality(urls, n);
+  printf("hash speed, short keys\n");
+  bench_hash_speed(keys, n);
+  printf("hash speed, url keys\n");
+  bench_hash_speed(urls, n);
+
+  free_keys(keys, n);
+  free_keys(urls, n);
+}
+
+/**
+ * Time insertion, hit lookup, and miss lookup over `n` keys.
+ */
+static void bench_ops(int n) {
+  char **keys = make_keys(n, "key");
+  char **missing = make_keys(n, "missing");
+  printf("map operations (n = %d)\n", n);
+
+  map m = map_create();
+  double start = now();
+  for (int i = 0; i < n; i += 1) {
+    map_set(m, keys[i], keys[i]);
+  }
+  report("map_set (insert)", now() - start, n);
+
+  // Accumulate results so the lookups cannot be optimized away.
+  size_t sink = 0;
+  start = now();
+  for (int i = 0; i < n; i += 1) {
+    sink += (size_t) map_get(m, keys[i]);
+  }
+  report("map_get (hit)", now() - start, n);
+
+  // The lookups above visit keys in insertion order, and so visit anything
+  // allocated per key in the order it was allocated. Real lookups rarely do.
+  char **reordered = malloc(n * sizeof (char *));
+  memcpy(reordered, keys, n * sizeof (char *));
+  shuffle(reordered, n);
+  start = now();
+  for (int i = 0; i < n; i += 1) {
+    sink += (size_t) map_get(m, reordered[i]);
+  }
+  report("map_get (hit, reordered)", now() - start, n);
+  free(reordered);
+
+  start = now();
+  for (int i = 0; i < n; i += 1) {
+    sink += map_contains(m, missing[i]);
+  }
+  report("map_contains (miss)", now() - start, n);
+
+  // Full iteration, with and without an iterator object.
+  start = now();
+  for (const char *key = map_first(m); key != NULL; key = map_next(m, key)) {
+    sink += (size_t) key;
+  }
+  report("map_first/map_next", now() - start, n);
+
+  start = now();
+  map_iter it = map_iter_start(m);
+  for (const char *key; (key = map_iter_next(&it)) != NULL;) {
+    sink += (size_t) key;
+  }
+  report("map_iter_next", now() - start, n);
+
+  // Full scans of keys and values: looking each value up, or reading it
+  // straight from the iterator.
+  start = now();
+  it = map_iter_start(m);
+  for (const char *key; (key = map_iter_next(&it)) != NULL;) {
+    sink += (size_t) map_get(m, key);
+  }
+  report("map_iter_next + map_get", now() - start, n);
+
+  start = now();
+  it = map_iter_start(m);
+  const char *key;
+  size_t len;
+  void *value;
+  while (map_iter_next_entry(&it, &key, &len, &value)) {
+    sink += len + (size_t) value;
+  }
+  report("map_iter_next_entry", now() - start, n);
+
+  // Batched lookups, against the same keys as the individual lookups above.
+  void **values = malloc(n * sizeof (void *));
+  start = now();
+  map_get_batch(m, (const char *const *) keys, n, values, NULL);
+  report("map_get_batch (hit)", now() - start, n);
+  for (int i = 0; i < n; i += 1) {
+    sink += (size_t) values[i];
+  }
+
+  bool *found = malloc(n * sizeof (bool));
+  start = now();
+  map_get_batch(m, (const char *const *) missing, n, values, found);
+  report("map_get_batch (miss)", now() - start, n);
+  for (int i = 0; i < n; i += 1) {
+    sink += found[i];
+  }
+  free(values);
+  free(found);
+
+  start = now();
+  for (int i = 0; i < n; i += 1) {
+    sink += (size_t) map_remove(m, keys[i]);
+  }
+  report("map_remove", now() - start, n);
+
+  map_destroy(m);
+
+  // Bulk construction, against the individual insertions above.
+  start = now();
+  m = map_build((const char *const *) keys, NULL, (void *const *) keys, n);
+  report("map_build", now() - start, n);
+  map_destroy(m);
+
+  free_keys(keys, n);
+  free_keys(missing, n);
+  if (sink == 1) printf("\n");
+}
+
+// Bytes currently allocated through `counting_allocator`.
+static size_t allocated;
+
+/**
+ * Allocation callbacks that keep `allocated` up to date, so that a map's
+ * memory use can be measured exactly.
+ */
+static void *count_alloc(void *ctx, size_t size) {
+  (void) ctx;
+  allocated += size;
+  return malloc(size);
+}
+static void *count_realloc(void *ctx, void *block, size_t old_size,
+    size_t new_size) {
+  (void) ctx;
+  allocated += new_size - old_size;
+  return realloc(block, new_size);
+}
+static void count_free(void *ctx, void *block, size_t size) {
+  (void) ctx;
+  allocated -= size;
+  free(block);
+}
+static const struct map_allocator counting_allocator = {
+  count_alloc, count_realloc, count_free, NULL,
+};
+
+/**
+ * Measure the tradeoff between memory and lookup speed across maximum load
+ * factors. Each map is filled to exactly its maximum load in a table of the
+ * same capacity, the largest power of two up to `n`, so rows differ only in
+ * how full that table is.
+ */
+static void bench_load(int n) {
+  static const double loads[] = {0.5, 0.625, 0.75, 0.875, 0.9, 0.95, 0.99};
+  int capacity = 1;
+  while (capacity * 2 <= n) capacity *= 2;
+  char **keys = make_keys(n, "key");
+  char **missing = make_keys(n, "missing");
+  char **reordered = malloc(n * sizeof (char *));
+  printf("max load factor (capacity = %d)\n", capacity);
+  printf("  %-6s %8s %12s %12s %12s\n", "load", "keys", "bytes/key",
+      "hit ns/op", "miss ns/op");
+
+  size_t sink = 0;
+  for (size_t l = 0; l < sizeof loads / sizeof loads[0]; l += 1) {
+    int k = (int) (capacity * loads[l]);
+    struct map_config config = {0};
+    config.capacity = k;
+    config.max_load = loads[l];
+    config.allocator = &counting_allocator;
+    map m = map_create_with_config(&config);
+    for (int i = 0; i < k; i += 1) {
+      map_set(m, keys[i], keys[i]);
+    }
+    double bytes = (double) allocated / k;
+
+    memcpy(reordered, keys, k * sizeof (char *));
+    shuffle(reordered, k);
+    double start = now();
+    for (int i = 0; i < k; i += 1) {
+      sink += (size_t) map_get(m, reordered[i]);
+    }
+    double hit = now() - start;
+
+    start = now();
+    for (int i = 0; i < k; i += 1) {
+      sink += map_contains(m, missing[i]);
+    }
+    double miss = now() - start;
+
+    printf("  %-6.3f %8d %12.1f %12.1f %12.1f\n", loads[l], k, bytes,
+        hit * 1e9 / k, miss * 1e9 / k);
+    map_destroy(m);
+  }
+
+  free(reordered);
+  free_keys(keys, n);
+  free_keys(missing, n);
+  if (sink == 1) printf("\n");
+}
+
+/**
+ * Compare several maps keyed by the same `n` long keys, each holding its own
+ * copies of the keys, against the same maps sharing the keys through a pool.
+ * Reports the memory used per key across all of the maps, and the cost of
+ * looking keys up by the caller's copies or by their interned copies.
+ */
+static void bench_pool(int n) {
+  enum { MAPS = 8 };
+  char **keys = make_url_keys(n);
+  shuffle(keys, n);
+  const char **interned = malloc(n * sizeof (char *));
+  map maps[MAPS];
+  printf("key pool (n = %d, %d maps)\n", n, MAPS);
+
+  for (int pooled = 0; pooled < 2; pooled += 1) {
+    size_t base = allocated;
+    struct map_config config = {0};
+    config.allocator = &counting_allocator;
+    map pool = NULL;
+    if (pooled) {
+      pool = map_create_pool(&config);
+      config.pool = pool;
+    }
+    for (int j = 0; j < MAPS; j += 1) {
+      maps[j] = map_create_with_config(&config);
+      for (int i = 0; i < n; i += 1) {
+        map_set(maps[j], keys[i], keys[i]);
+      }
+    }
+    printf("  %-24s %8.1f bytes/key\n", pooled ? "pooled" : "copied",
+        (double) (allocated - base) / n);
+
+    size_t sink = 0;
+    double start = now();
+    for (int i = 0; i < n; i += 1) {
+      sink += (size_t) map_get(maps[i % MAPS], keys[i]);
+    }
+    report(pooled ? "map_get (pooled)" : "map_get (copied)", now() - start,
+        n);
+
+    if (pooled) {
+      for (int i = 0; i < n; i += 1) {
+        interned[i] = map_intern(pool, keys[i]);
+      }
+      start = now();
+      for (int i = 0; i < n; i += 1) {
+        sink += (size_t) map_get(maps[i % MAPS], interned[i]);
+      }
+      report("map_get (interned)", now() - start, n);
+    }
+
+    for (int j = 0; j < MAPS; j += 1) {
+      map_destroy(maps[j]);
+    }
+    if (pool != NULL) map_destroy(pool);
+    if (sink == 1) printf("\n");
+  }
+
+  free(interned);
+  free_keys(keys, n);
+}
+
+/**
+ * Compare a map that copies `n` long keys against one that borrows them from
+ * the caller, reporting the cost of inserting and looking up each key and the
+ * memory used per key.
+ */
+static void bench_borrow(int n) {
+  char **keys = make_url_keys(n);
+  shuffle(keys, n);
+  printf("borrowed keys (n = %d)\n", n);
+
+  for (int borrow = 0; borrow < 2; borrow += 1) {
+    size_t base = allocated;
+    struct map_config config = {0};
+    config.allocator = &counting_allocator;
+    config.borrow_keys = borrow;
+    map m = map_create_with_config(&config);
+    double start = now();
+    for (int i = 0; i < n; i += 1) {
+      map_set(m, keys[i], keys[i]);
+    }
+    report(borrow ? "map_set (borrowed)" : "map_set (copied)", now() - start,
+        n);
+    printf("  %-24s %8.1f bytes/key\n", borrow ? "memory (borrowed)" :
+        "memory (copied)", (double) (allocated - base) / n);
+
+    size_t sink = 0;
+    start = now();
+    for (int i = n - 1; i >= 0; i -= 1) {
+      sink += (size_t) map_get(m, keys[i]);
+    }
+    report(borrow ? "map_get (borrowed)" : "map_get (copied)", now() - start,
+        n);
+    map_destroy(m);
+    if (sink == 1) printf("\n");
+  }
+
+  free_keys(keys, n);
+}
+
+/**
+ * Internal helper for `qsort`; compare two durations.
+ */
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Time each individual insertion of `n` keys, with and without incremental
+ * resizing, and report the tail latencies.
+ */
+static void bench_latency(int n) {
+  char **keys = make_keys(n, "key");
+  double *times = malloc(n * sizeof (double));
+  printf("map_set latency (n = %d)\n", n);
+
+  for (int incremental = 0; incremental < 2; incremental += 1) {
+    map m = map_create();
+    map_set_incremental_resize(m, incremental);
+    for (int i = 0; i < n; i += 1) {
+      double start = now();
+      map_set(m, keys[i], keys[i]);
+      times[i] = now() - start;
+    }
+    map_destroy(m);
+
+    qsort(times, n, sizeof (double), compare_doubles);
+    printf("  %-12s p50 %8.0f ns  p99.9 %8.0f ns  max %10.0f ns\n",
+        incremental ? "incremental" : "default", times[n / 2] * 1e9,
+        times[n - 1 - n / 1000] * 1e9, times[n - 1] * 1e9);
+  }
+
+  free(times);
+  free_keys(keys, n);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  srand(1);
+  bench_hash(n);
+  bench_ops(n);
+  bench_latency(n);
+  bench_load(n);
+  bench_pool(n / 8);
+  bench_borrow(n);
+  return 0;
+}
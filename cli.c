@@ -42,8 +42,11 @@ bool read_cmd(char *dest) {
  */
 void do_cleanup(map m) {
   if (m != NULL) {
-    for (const char *key = map_first(m); key != NULL; key = map_next(m, key)) {
-        free(map_get(m, key));
+    map_iter it = map_iter_start(m);
+    const char *key;
+    void *value;
+    while (map_iter_next_entry(&it, &key, NULL, &value)) {
+        free(value);
     }
     map_destroy(m);
   }
@@ -157,9 +160,11 @@ void run_cmd(char *line) {
     if (!parse(line, cmd)) return;
     if (!ensure_exists(m)) return;
 
-    for (const char *key = map_first(m); key != NULL; key = map_next(m, key)) {
-      const char *value = map_get(m, key);
-      printf("    %s: %s\n", key, value);
+    map_iter it = map_iter_start(m);
+    const char *key;
+    void *value;
+    while (map_iter_next_entry(&it, &key, NULL, &value)) {
+      printf("    %s: %s\n", key, (const char *) value);
     }
   }
 
@@ -184,7 +189,11 @@ void run_cmd(char *line) {
     if (!parse_ss(line, cmd, &key, &value)) return;
     if (!ensure_exists(m)) return;
 
-    map_set(m, key, value);
+    // Free the value being replaced, if there is one.
+    bool inserted;
+    void **entry = map_entry(m, key, &inserted);
+    if (!inserted) free(*entry);
+    *entry = value;
     printf("    %s: %s\n", key, value);
     free(key);
   }
@@ -196,11 +205,11 @@ void run_cmd(char *line) {
     if (!ensure_exists(m)) return;
 
     // Cannot get a nonexistent key.
-    if (!map_contains(m, key)) {
+    void *value;
+    if (!map_try_get(m, key, &value)) {
       printf("    error; key not found\n");
     } else {
-      char *value = map_get(m, key);
-      printf("    %s: %s\n", key, value);
+      printf("    %s: %s\n", key, (char *) value);
     }
     free(key);
   }
@@ -212,10 +221,10 @@ void run_cmd(char *line) {
     if (!ensure_exists(m)) return;
 
     // Cannot remove nonexistent key.
-    if (!map_contains(m, key)) {
+    void *value;
+    if (!map_try_remove(m, key, &value)) {
       printf("    error; key not found\n");
     } else {
-      char *value = map_remove(m, key);
       printf("    %s: <deleted>\n", key);
       free(value);
     }
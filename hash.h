@@ -0,0 +1,156 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * String hash functions used by the map implementation.
+ * 
+ * This header is internal to the map (it is not needed to use `map.h`), but is
+ * kept separate so that the benchmarks can compare the available functions
+ * directly. Every function hashes `len` bytes starting at `key`, keyed with a
+ * 64-bit `seed`, and produces a 64-bit hash whose bits are all well mixed,
+ * since the map uses the low bits to pick a slot.
+ */
+
+/**
+ * The original string hash: a multiply-by-31/XOR loop over one byte at a time
+ * with a 32-bit state, followed by a 64-bit finalizer (MurmurHash3's `fmix64`)
+ * to spread that state across all 64 output bits.
+ * 
+ * Since the loop keeps only 32 bits of state, distinct keys collide in the
+ * full 64-bit hash far more often than they would with `hash_wy`. The seed only
+ * perturbs the starting state, which is not enough to stop an attacker from
+ * finding colliding keys; use `hash_wy` where keys are untrusted.
+ */
+static inline uint64_t hash_legacy(const char *key, size_t len, uint64_t seed) {
+  uint32_t state = -1 ^ (uint32_t) (seed ^ (seed >> 32));
+  for (size_t i = 0; i < len; i += 1) {
+    state *= 31;
+    state ^= (unsigned char) key[i];
+  }
+
+  uint64_t hash = state ^ seed;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/**
+ * Internal helper; multiply two 64-bit values into a 128-bit product, leaving
+ * the low half in `*a` and the high half in `*b`.
+ */
+static inline void hash_wy_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t) *a * *b;
+  *a = (uint64_t) r;
+  *b = (uint64_t) (r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+/**
+ * Internal helper; multiply two 64-bit values and fold the halves of the
+ * 128-bit product together.
+ */
+static inline uint64_t hash_wy_mix(uint64_t a, uint64_t b) {
+  hash_wy_mum(&a, &b);
+  return a ^ b;
+}
+
+/**
+ * Internal helpers; read 8, 4, or 1-3 bytes from unaligned memory.
+ */
+static inline uint64_t hash_wy_r8(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+static inline uint64_t hash_wy_r4(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+static inline uint64_t hash_wy_r3(const unsigned char *p, size_t len) {
+  return ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+}
+
+/**
+ * A word-at-a-time hash, following the structure of wyhash (final version 4,
+ * released into the public domain by Wang Yi).
+ * 
+ * Keys of up to 16 bytes are hashed with a handful of overlapping loads and a
+ * single multiply. Longer keys are consumed 16 bytes (or, past 48 bytes, 48
+ * bytes in three independent lanes) per step, so hashing cost is dominated by
+ * memory bandwidth rather than a per-byte dependency chain.
+ * 
+ * Every step mixes in the seed, so without knowing it an attacker cannot
+ * predict which keys will collide.
+ */
+static inline uint64_t hash_wy(const char *key, size_t len, uint64_t seed) {
+  static const uint64_t secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+  };
+  const unsigned char *p = (const unsigned char *) key;
+  uint64_t a, b;
+  seed ^= hash_wy_mix(seed ^ secret[0], secret[1]);
+
+  if (len <= 16) {
+    if (len >= 4) {
+      size_t off = (len >> 3) << 2;
+      a = (hash_wy_r4(p) << 32) | hash_wy_r4(p + off);
+      b = (hash_wy_r4(p + len - 4) << 32) | hash_wy_r4(p + len - 4 - off);
+    } else if (len > 0) {
+      a = hash_wy_r3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = hash_wy_mix(hash_wy_r8(p) ^ secret[1], hash_wy_r8(p + 8) ^ seed);
+        see1 = hash_wy_mix(hash_wy_r8(p + 16) ^ secret[2],
+            hash_wy_r8(p + 24) ^ see1);
+        see2 = hash_wy_mix(hash_wy_r8(p + 32) ^ secret[3],
+            hash_wy_r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = hash_wy_mix(hash_wy_r8(p) ^ secret[1], hash_wy_r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+
+    // The final 16 bytes are read relative to the end of the key, overlapping
+    // bytes that were already consumed when the tail is short.
+    a = hash_wy_r8(p + i - 16);
+    b = hash_wy_r8(p + i - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  hash_wy_mum(&a, &b);
+  return hash_wy_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+#endif
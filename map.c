@@ -1,43 +1,387 @@
 #include "map.h"
+#include "hash.h"
+#include "arena.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+// Control byte values. Every slot in the table has a matching control byte
+// describing its state, so probing can skip over slots without touching the
+// (larger) slot array.
+// 
+// By default, a full slot's control byte holds the top 7 bits of its key's hash
+// (see `CTRL_H2`), so that probing can also skip almost every slot holding a
+// different key without reading it. Empty and deleted slots have the high bit
+// set. Building with `-DMAP_ROBIN_HOOD` selects Robin Hood hashing instead, in
+// which a full slot's control byte holds how far it sits from its key's home
+// slot, plus one (see `rh_ctrl`), and empty slots are zero.
+#ifdef MAP_ROBIN_HOOD
+#define CTRL_EMPTY 0
+#define CTRL_FAR 0xff
+#define CTRL_IS_FULL(c) ((c) != CTRL_EMPTY)
+#else
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_H2(h) ((unsigned char) ((h) >> 57))
+#define CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+
+// Control bytes are examined a group at a time: 16 at once with SSE2, or else
+// 8 at once packed into a 64-bit integer. Build with `-DMAP_NO_SIMD` to use the
+// portable version even where SSE2 is available.
+// 
+// A group may start at any slot, so the first `GROUP_WIDTH - 1` control bytes
+// are mirrored after the last one, and a group starting near the end of the
+// table reads on into slots at its start. Matching returns a bit mask with
+// `1 << GROUP_SHIFT` bits per slot, ordered from the group's first slot up.
+#if defined(__SSE2__) && !defined(MAP_NO_SIMD)
+#include <emmintrin.h>
+#define GROUP_WIDTH 16
+#define GROUP_SHIFT 0
+typedef __m128i group;
+typedef uint32_t group_mask;
+#else
+#define GROUP_WIDTH 8
+#define GROUP_SHIFT 3
+typedef uint64_t group;
+typedef uint64_t group_mask;
+#endif
+#endif
+
+// Robin Hood hashing examines control bytes one at a time, and so needs no
+// mirrored control bytes past the end of the table.
+#ifdef MAP_ROBIN_HOOD
+#define GROUP_WIDTH 1
+#endif
+
+// Capacity of a freshly created map. Capacities are always powers of two, so
+// that a hash can be reduced to a slot index by masking off its high bits.
+#define MIN_CAPACITY 8
+
+// Fraction of a table's slots that may be used before it must grow, unless a
+// map is created with its own (see `struct map_config`): 7/8 of them, or 9/10
+// with Robin Hood hashing, whose probe sequences stay short at higher load.
+#ifdef MAP_ROBIN_HOOD
+#define DEFAULT_MAX_LOAD 0.9
+#else
+#define DEFAULT_MAX_LOAD 0.875
+#endif
+
+// Lowest maximum load a map may be given, at which even the smallest table can
+// hold a key. A map can never be allowed to fill up completely either, since
+// probing relies on finding an empty slot (see `load_limit`).
+#define MIN_MAX_LOAD 0.125
+
+// Number of slots of the old table examined by each write operation while an
+// incremental resize is in progress.
+#define MIGRATE_STEP 32
+
+// Whether the compact table layout is selected (see `struct table`).
+#ifdef MAP_COMPACT
+#define COMPACT true
+#else
+#define COMPACT false
+#endif
+
+// Returned by `table_find` when a key is not present.
+#define NOT_FOUND ((size_t) -1)
+
+// Number of keys looked up together by `map_get_batch`. Enough to keep many
+// cache misses in flight, while its per-key state still fits on the stack.
+#define BATCH_SIZE 16
+
+// Hint that memory will be read soon, where the compiler supports it.
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) (p))
+#endif
+
+// Keys of up to `INLINE_MAX` bytes are stored inline in their slot. The last
+// byte of the inline buffer holds the number of bytes left unused, so that it
+// doubles as the NUL terminator of a key that fills the whole buffer. Longer
+// keys are stored in a cell instead, and mark that byte with `KEY_CELL`. In the
+// compact layout, removed entries mark it with `KEY_HOLE`. Maps that borrow
+// their keys store the caller's pointer to every key and its length instead,
+// and mark that byte with `KEY_BORROWED`.
+#define INLINE_MAX 15
+#define KEY_CELL 0xff
+#define KEY_HOLE 0xfe
+#define KEY_BORROWED 0xfd
+
+// Keys are stored as `len` bytes followed by a NUL terminator, so that keys
+// without embedded NULs can also be used as strings.
 struct cell {
-  struct cell *next;
-  void *value;
+  size_t len;
   char key[];
-} cell;
+};
+
+// Each slot caches the full hash of its key, so that probing can reject almost
+// every non-matching key without comparing it, and so that resizing never
+// needs to rehash key strings. Slots also hold their values, and short keys,
+// so that looking up a short key touches nothing but its slot.
+struct slot {
+  uint64_t hash;
+  void *value;
+  union {
+    char key[INLINE_MAX + 1];
+    struct cell *cell;
+    struct {
+      const char *key;
+      uint32_t len;
+    } borrowed;
+  };
+};
+
+// By default, a table's slots are stored directly in `slots`, one for each
+// control byte. Building with `-DMAP_COMPACT` selects a compact layout, in
+// which the slots are instead appended to `entries` in insertion order, and the
+// table only stores each one's position in `entries` in `index`. Removing a key
+// leaves a hole (see `KEY_HOLE`) in `entries`, which is squeezed out the next
+// time the table is rebuilt. Iterating then scans a dense array in insertion
+// order, and `entries` grows with the number of keys rather than the capacity.
+struct table {
+  unsigned char *ctrl;
+#ifdef MAP_COMPACT
+  uint32_t *index;
+  struct slot *entries;
+  size_t used;
+  size_t room;
+#else
+  struct slot *slots;
+#endif
+  size_t capacity;
+  size_t size;
+  size_t deleted;
+  size_t limit;
+};
 
+// Keys are hashed with `hash_seed`, which is shared by every map in the
+// process unless one is created with its own seed, so that a key's hash can be
+// computed once and reused across maps. The shared hash is then scrambled with
+// `slot_seed`, which differs between maps, to choose the key's slot.
+// 
+// During a resize, entries are moved from `old` into `table` a few slots at a
+// time, starting at slot `migrated` of `old`. Until the move completes, a key
+// may live in either table; new keys always go into `table`. When no resize is
+// in progress, `old` has zero capacity.
+// 
+// Cells for long keys are allocated from `cells`, which the map owns. All
+// memory, including the map itself, comes from `allocator`. A map created with
+// a `pool` instead stores every key as a pointer to the pool's cell for it. A
+// pool is a map whose `pool` is itself; it stores every key in a cell of its
+// own, which is never freed before the pool itself. A map that borrows its keys
+// (see `KEY_BORROWED`) stores none of them at all.
+// 
+// Each table may use at most `max_load` of its slots, counting tombstones; the
+// resulting number of slots is cached in the table's `limit`.
 struct map {
-  struct cell **elems;
-  int capacity;
-  int size;
+  struct table table;
+  struct table old;
+  size_t migrated;
+  struct arena cells;
+  map pool;
+  bool borrow_keys;
+  struct map_allocator allocator;
+  uint64_t hash_seed;
+  uint64_t slot_seed;
+  double max_load;
+  bool incremental;
 };
 
 // Internal helper functions. Implemented at the bottom of this file.
-static unsigned int hash(const char *key);
-static void extend_if_necessary(map m);
+static void *default_alloc(void *ctx, size_t size);
+static void *default_realloc(void *ctx, void *block, size_t old_size,
+    size_t new_size);
+static void default_free(void *ctx, void *block, size_t size);
+static uint64_t hash(const map m, const char *key, size_t len);
+static uint64_t prehashed(const map m, const char *key, size_t len,
+    map_hash_t h);
+static uint64_t hash_with(uint64_t seed, const char *key, size_t len);
+static uint64_t scramble(const map m, uint64_t h);
+static uint64_t shared_seed();
+static uint64_t random_seed();
+static void init_seeds();
+static uint64_t next_seed();
+static map create(uint64_t hash_seed, uint64_t slot_seed,
+    const struct map_config *config);
+static size_t capacity_for(const map m, size_t n);
+static size_t load_limit(const map m, size_t capacity);
+static bool owns_cell(const map m, size_t len);
+static struct cell *intern(map pool, const char *key, size_t len);
+static void table_init(map m, struct table *t, size_t capacity);
+static void table_free(map m, struct table *t);
+#ifdef MAP_ROBIN_HOOD
+static unsigned char rh_ctrl(size_t dist);
+static void table_move(struct table *t, size_t from, size_t to);
+#else
+static void table_set_ctrl(struct table *t, size_t i, unsigned char c);
+static group group_load(const unsigned char *ctrl);
+static group_mask group_match(group g, unsigned char c);
+static group_mask group_free(group g);
+static size_t group_first(group_mask bits);
+#endif
+static void table_reserve(map m, struct table *t, size_t n);
+static struct slot *table_slot(const struct table *t, size_t i);
+static void table_prefetch(const struct table *t, size_t i);
+static size_t table_probe(const struct table *t, const char *key, size_t len,
+    uint64_t h, size_t *vacant);
+static size_t table_find(const struct table *t, const char *key, size_t len,
+    uint64_t h);
+static struct slot *table_place(struct table *t, size_t i,
+    const struct slot *s);
+static void table_insert(struct table *t, const struct slot *s);
+static void table_erase(struct table *t, size_t i);
+static struct table *find(const map m, const char *key, size_t len,
+    uint64_t h, size_t *i);
+static void **entry(map m, const char *key, size_t len, uint64_t h,
+    bool *inserted);
+static bool try_get(const map m, const char *key, size_t len, uint64_t h,
+    void **value);
+static struct slot *iter_next(map_iter *it);
+static struct slot *table_array(const struct table *t, size_t *n);
+static unsigned char slot_tag(const struct slot *s);
+static const char *slot_key(const struct slot *s);
+static size_t slot_len(const struct slot *s);
+static bool extend_if_necessary(map m);
+static void shrink_if_necessary(map m);
+static void resize(map m, size_t capacity);
+static void migrate(map m, size_t budget);
+static void compact_cells(map m);
+
+static const struct map_allocator default_allocator = {
+  default_alloc, default_realloc, default_free, NULL,
+};
+
+// State of the generator behind `random_seed`, and the seed shared by maps in
+// this process, both set up on first use by `init_seeds`.
+static pthread_once_t seeds_once = PTHREAD_ONCE_INIT;
+static _Atomic uint64_t seeds_state;
+static uint64_t seeds_shared;
 
 /**
  * Create a new, empty map.
  * 
  * The returned map has dynamically allocated memory associated with it, and
  * this memory must be reclaimed after use with `map_destroy`.
+ * 
+ * Keys are hashed with a random seed, so that keys which collide in one run of
+ * a program will not predictably collide in another, and each map places the
+ * hashes in its slots with its own random seed on top of that. This keeps
+ * lookups fast even when keys come from an untrusted source that might try to
+ * force collisions.
  */
 map map_create() {
+  struct map_config config = {0};
+  return create(shared_seed(), random_seed(), &config);
+}
 
-  // Allocate space for the map's primary data structure. More space will be 
-  // allocated in the future when values are added to the map.
-  map m = malloc(sizeof (map));
-  assert(m != NULL);
-  m->elems = calloc(1, sizeof (struct cell *));
-  assert(m->elems != NULL);
+/**
+ * Create a new, empty map whose hash function is keyed with a given seed.
+ * 
+ * Maps created with the same seed lay out the same keys identically, which is
+ * useful for reproducing iteration order between runs. Seeds should be chosen
+ * randomly when keys may come from an untrusted source. Since such a map does
+ * not use the shared seed, it cannot reuse hashes from `map_hash_key`.
+ */
+map map_create_seeded(uint64_t seed) {
+  struct map_config config = {0};
+  return create(seed, seed, &config);
+}
+
+/**
+ * Create a new, empty map with room for at least `n` keys.
+ * 
+ * Adding up to `n` keys to the returned map will not cause it to grow, so a map
+ * whose final size is known up front can be filled without ever moving its
+ * entries.
+ */
+map map_create_with_capacity(size_t n) {
+  struct map_config config = {0};
+  config.capacity = n;
+  return create(shared_seed(), random_seed(), &config);
+}
 
-  // Initialize metadata. The map starts with capacity for one entry.
-  m->capacity = 1;
-  m->size = 0;
+/**
+ * Create a new, empty map that allocates all of its memory with the given
+ * callbacks.
+ * 
+ * The callbacks are copied into the map, but `allocator->ctx` must remain
+ * valid until the map is destroyed.
+ */
+map map_create_with_allocator(const struct map_allocator *allocator) {
+  struct map_config config = {0};
+  config.allocator = allocator;
+  return create(shared_seed(), random_seed(), &config);
+}
+
+/**
+ * Create a new, empty map with the given options.
+ * 
+ * The config is only read during this call.
+ */
+map map_create_with_config(const struct map_config *config) {
+  return create(shared_seed(), random_seed(), config);
+}
+
+/**
+ * Create a new, empty pool of interned strings, for sharing key storage
+ * between maps created with it as their `pool` (see `struct map_config`).
+ * 
+ * A pool is itself a map, whose keys are the strings interned in it. Each
+ * string is stored only once, however many maps use it as a key, and stays at
+ * the same address until the pool is destroyed with `map_destroy`, even if it
+ * is removed from the pool. Keys returned by a map that uses a pool are the
+ * pool's copies.
+ * 
+ * The pool is created with the given options, as for `map_create_with_config`,
+ * or the defaults if `config` is NULL. Its `pool` must be NULL, and it must
+ * not set `borrow_keys`, since a pool always holds its own copy of each
+ * string.
+ */
+map map_create_pool(const struct map_config *config) {
+  struct map_config defaults = {0};
+  if (config == NULL) config = &defaults;
+  bool valid = config->pool == NULL && !config->borrow_keys;
+  assert(valid);
+  if (!valid) exit(1);
+  map pool = map_create_with_config(config);
+  pool->pool = pool;
+  return pool;
+}
+
+/**
+ * Get the copy of a string stored in a pool, adding it if necessary.
+ * 
+ * Since a pool holds one copy of each string, interned strings are equal
+ * exactly when their pointers are. Maps that use the pool compare keys by
+ * pointer before comparing their bytes, so looking up a key by its interned
+ * copy never reads the key itself.
+ */
+const char *map_intern(map pool, const char *key) {
+  return map_intern_n(pool, key, strlen(key));
+}
+
+/**
+ * Same as `map_intern`, for a key of `len` bytes.
+ */
+const char *map_intern_n(map pool, const char *key, size_t len) {
+  return intern(pool, key, len)->key;
+}
 
+/**
+ * Create a new map holding `n` keys and their values.
+ * 
+ * Equivalent to creating a map and calling `map_set_batch` on it, but the map
+ * is created at its final size.
+ */
+map map_build(const char *const *keys, const size_t *lens,
+    void *const *values, size_t n) {
+  map m = map_create_with_capacity(n);
+  map_set_batch(m, keys, lens, values, n);
   return m;
 }
 
@@ -50,25 +394,86 @@ map map_create() {
  */
 void map_destroy(map m) {
 
-  // Loop over each cell in the map and free it.
-  for (int i = 0; i < m->capacity; i += 1) {
-    struct cell *curr = m->elems[i];
-    while (curr != NULL) {
-      struct cell *next = curr->next;
-      free(curr);
-      curr = next;
-    }
-  }
-
-  free(m->elems);
-  free(m);
+  // Every cell lives in the map's arena, so they can all be freed at once
+  // without visiting them. Cells belonging to a pool are left to the pool.
+  arena_destroy(&m->cells);
+  table_free(m, &m->old);
+  table_free(m, &m->table);
+  m->allocator.free(m->allocator.ctx, m, sizeof (struct map));
 }
 
 /**
  * Get the size of a map.
  */
 int map_size(const map m) {
-  return m->size;
+  return m->table.size + m->old.size;
+}
+
+/**
+ * Make room in a map for at least `n` keys in total.
+ * 
+ * After this call, the map will not need to grow again until it holds more
+ * than `n` keys. This never shrinks a map.
+ */
+void map_reserve(map m, size_t n) {
+  size_t capacity = capacity_for(m, n);
+  if (capacity > m->table.capacity) {
+    migrate(m, (size_t) -1);
+    resize(m, capacity);
+  }
+  table_reserve(m, &m->table, n);
+}
+
+/**
+ * Shrink a map's memory to fit its current keys.
+ * 
+ * Maps shrink on their own once removals leave them mostly empty, but only
+ * after a wide margin, so that a map whose size hovers around a threshold does
+ * not repeatedly grow and shrink. This call shrinks a map's table as far as
+ * possible immediately, which is useful once a map is known to have reached
+ * its long-term size. Memory for long keys is otherwise only given back when
+ * the map is destroyed, so if most of it has been freed, the remaining keys
+ * are also copied into fresh storage. Pools never move their strings, so they
+ * keep this memory until they are destroyed.
+ */
+void map_shrink_to_fit(map m) {
+  migrate(m, (size_t) -1);
+
+  // Rebuild whenever it would free memory, including memory held by
+  // tombstones, and finish the move straight away even in incremental mode.
+  size_t capacity = capacity_for(m, m->table.size);
+  if (capacity < m->table.capacity || m->table.deleted > 0) {
+    resize(m, capacity);
+    migrate(m, (size_t) -1);
+  }
+
+  // Cells are only freed along with their arena, so copy them into a fresh one
+  // once most of the old one is free. A pool's cells must never move, since
+  // other maps point at them.
+  if (m->pool == NULL && arena_is_sparse(&m->cells)) {
+    compact_cells(m);
+  }
+}
+
+/**
+ * Choose whether a map grows incrementally.
+ * 
+ * By default, a map that runs out of room moves all of its entries into a
+ * larger table at once, so the insertion that triggers growth takes time
+ * proportional to the size of the map. With incremental resizing enabled, the
+ * old and new tables instead coexist while entries are moved across a bounded
+ * number of slots at a time, during each later `map_set` and `map_remove`.
+ * This bounds the work of moving entries in every operation, at the price of
+ * lookups checking both tables while a resize is in progress. The operation
+ * that finishes the move still frees the old table in a single call to the
+ * allocator, which can take time proportional to the table's size for large
+ * maps.
+ * 
+ * Maps built with `-DMAP_COMPACT` always resize at once, so for them this
+ * has no effect.
+ */
+void map_set_incremental_resize(map m, bool enabled) {
+  m->incremental = enabled;
 }
 
 /**
@@ -77,13 +482,15 @@ int map_size(const map m) {
  * Keys are case-sensitive.
  */
 bool map_contains(const map m, const char *key) {
-  int b = hash(key) % m->capacity;
+  return map_contains_n(m, key, strlen(key));
+}
 
-  // Search linearly for a matching key through the appropriate linked list.
-  for (struct cell *curr = m->elems[b]; curr != NULL; curr = curr->next) {
-    if (strcmp(curr->key, key) == 0) return true;
-  }
-  return false;
+/**
+ * Same as `map_contains`, for a key of `len` bytes.
+ */
+bool map_contains_n(const map m, const char *key, size_t len) {
+  size_t i;
+  return find(m, key, len, hash(m, key, len), &i) != NULL;
 }
 
 /**
@@ -93,28 +500,152 @@ bool map_contains(const map m, const char *key) {
  * new value will replace the old one.
  */
 void map_set(map m, const char *key, void *value) {
-  int b = hash(key) % m->capacity;
-
-  // First, look for an existing entry with the given key in the map. If it
-  // exists, simply update its value.
-  for (struct cell *curr = m->elems[b]; curr != NULL; curr = curr->next) {
-    if (strcmp(curr->key, key) == 0) {
-      curr->value = value;
-      return;
+  map_set_n(m, key, strlen(key), value);
+}
+
+/**
+ * Same as `map_set`, for a key of `len` bytes.
+ */
+void map_set_n(map m, const char *key, size_t len, void *value) {
+  bool inserted;
+  *map_entry_n(m, key, len, &inserted) = value;
+}
+
+/**
+ * Set the values for many keys in a map at once.
+ * 
+ * For each `i` below `n`, sets the value for key `keys[i]` to `values[i]`, as
+ * though by `map_set_n`. Each key is `lens[i]` bytes long, or if `lens` is
+ * NULL, a NUL-terminated string. If a key appears more than once, the last
+ * value wins.
+ * 
+ * The map is grown once up front, storage for all of the new keys is
+ * allocated as a single block, and keys are inserted in batches whose memory
+ * accesses overlap, so this is considerably faster than setting the keys one
+ * at a time. Both the map and the key storage are sized as though all `n`
+ * keys were new, so when most of them are already present, setting them one at
+ * a time avoids growing the map for nothing.
+ */
+void map_set_batch(map m, const char *const *keys, const size_t *lens,
+    void *const *values, size_t n) {
+
+  // Make room for every key up front, both in the table and (for keys that need
+  // a cell) in the arena. Cells too large for the arena's chunks are allocated
+  // on their own, so they need no room in the reserved chunk.
+  map_reserve(m, m->table.size + m->old.size + n);
+  size_t bytes = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    size_t len = lens != NULL ? lens[i] : strlen(keys[i]);
+    if (owns_cell(m, len)) {
+      size_t size = arena_block_size(sizeof (struct cell) + len + 1);
+      if (size <= ARENA_MAX_SMALL) bytes += size;
     }
   }
+  arena_reserve(&m->cells, bytes);
 
-  extend_if_necessary(m);
-  b = hash(key) % m->capacity;
+  for (size_t start = 0; start < n; start += BATCH_SIZE) {
+    size_t count = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+    size_t batch_lens[BATCH_SIZE];
+    uint64_t hashes[BATCH_SIZE];
 
-  // No existing key was found, so insert it as a new entry at the head of the
-  // list.
-  struct cell *new = malloc(sizeof (struct cell) + strlen(key) + 1);
-  new->next = m->elems[b];
-  new->value = value;
-  strcpy(new->key, key);
-  m->elems[b] = new;
-  m->size += 1;
+    // Hash every key in the batch, and start loading each key's home slot and
+    // control byte before any of them are inserted.
+    struct table *t = &m->table;
+    for (size_t i = 0; i < count; i += 1) {
+      const char *key = keys[start + i];
+      batch_lens[i] = lens != NULL ? lens[start + i] : strlen(key);
+      hashes[i] = hash(m, key, batch_lens[i]);
+      table_prefetch(t, hashes[i] & (t->capacity - 1));
+    }
+
+    for (size_t i = 0; i < count; i += 1) {
+      bool inserted;
+      *entry(m, keys[start + i], batch_lens[i], hashes[i], &inserted) =
+          values[start + i];
+    }
+  }
+}
+
+/**
+ * Find or add the entry for a given key within a map, and get a pointer to its
+ * value.
+ * 
+ * If the key is not already in the map, it is added with a NULL value, and
+ * `*inserted` is set to true; otherwise `*inserted` is set to false. Either
+ * way, the key is only hashed and looked up once, so reading and updating a
+ * value through the returned pointer (for example, incrementing a counter) is
+ * cheaper than separate calls to `map_contains`, `map_get`, and `map_set`.
+ * 
+ * The returned pointer is only valid until the map is next modified.
+ */
+void **map_entry(map m, const char *key, bool *inserted) {
+  return map_entry_n(m, key, strlen(key), inserted);
+}
+
+/**
+ * Same as `map_entry`, for a key of `len` bytes.
+ */
+void **map_entry_n(map m, const char *key, size_t len, bool *inserted) {
+  return entry(m, key, len, hash(m, key, len), inserted);
+}
+
+/**
+ * Internal helper; implements `map_entry_n`, given the key's hash `h`.
+ */
+static void **entry(map m, const char *key, size_t len, uint64_t h,
+    bool *inserted) {
+  migrate(m, MIGRATE_STEP);
+
+  // First, look for an existing entry with the given key in the map. The
+  // probe also finds where the key would go if it is not present.
+  size_t vacant;
+  size_t i = table_probe(&m->table, key, len, h, &vacant);
+  if (i != NOT_FOUND) {
+    *inserted = false;
+    return &table_slot(&m->table, i)->value;
+  }
+  if (m->old.size > 0) {
+    i = table_find(&m->old, key, len, h);
+    if (i != NOT_FOUND) {
+      *inserted = false;
+      return &table_slot(&m->old, i)->value;
+    }
+  }
+
+  // No existing key was found, so insert it as a new entry. Only if the table
+  // had to be rebuilt to make room does the key need to be probed for again.
+  if (extend_if_necessary(m)) {
+    table_probe(&m->table, key, len, h, &vacant);
+  }
+  table_reserve(m, &m->table, m->table.size + m->table.deleted + 1);
+  struct slot new = {0};
+  new.hash = h;
+  if (m->borrow_keys) {
+
+    // Borrowed lengths are stored in 32 bits, so longer keys cannot be kept.
+    bool fits = len <= UINT32_MAX;
+    assert(fits);
+    if (!fits) exit(1);
+    new.borrowed.key = key;
+    new.borrowed.len = (uint32_t) len;
+    new.key[INLINE_MAX] = (char) KEY_BORROWED;
+  } else if (m->pool != NULL && m->pool != m) {
+    new.cell = intern(m->pool, key, len);
+    new.key[INLINE_MAX] = (char) KEY_CELL;
+  } else if (!owns_cell(m, len)) {
+
+    // The rest of the inline buffer is left zeroed, which terminates the key.
+    memcpy(new.key, key, len);
+    new.key[INLINE_MAX] = INLINE_MAX - len;
+  } else {
+    new.cell = arena_alloc(&m->cells, sizeof (struct cell) + len + 1);
+    new.cell->len = len;
+    memcpy(new.cell->key, key, len);
+    new.cell->key[len] = '\0';
+    new.key[INLINE_MAX] = (char) KEY_CELL;
+  }
+  *inserted = true;
+  return &table_place(&m->table, vacant, &new)->value;
 }
 
 /**
@@ -123,63 +654,213 @@ void map_set(map m, const char *key, void *value) {
  * Crashes if the map does not contain the given key.
  */
 void *map_get(const map m, const char *key) {
-  int b = hash(key) % m->capacity;
+  return map_get_n(m, key, strlen(key));
+}
 
-  // Search linearly for a matching key through the appropriate linked list.
-  for (struct cell *curr = m->elems[b]; curr != NULL; curr = curr->next) {
-    if (strcmp(curr->key, key) == 0) return curr->value;
-  }
+/**
+ * Same as `map_get`, for a key of `len` bytes.
+ */
+void *map_get_n(const map m, const char *key, size_t len) {
+  void *value;
+  bool key_found = map_try_get_n(m, key, len, &value);
 
   // Key not found.
-  bool key_found = false;
   assert(key_found);
-  exit(1);
+  if (!key_found) exit(1);
+
+  return value;
 }
 
 /**
- * Remove a key and its value from a map.
+ * Retrieve the value for a given key in a map, if it exists.
  * 
- * Crashes if the map does not already contain the key.
+ * Returns whether the map contains the key. If it does, and `value` is not
+ * NULL, the key's value is stored in `*value`. This needs only one lookup,
+ * unlike calling `map_contains` before `map_get`.
  */
-void *map_remove(map m, const char *key) {
-  int b = hash(key) % m->capacity;
+bool map_try_get(const map m, const char *key, void **value) {
+  return map_try_get_n(m, key, strlen(key), value);
+}
 
-  // Here, use a double pointer to make removal easier.
-  struct cell **curr;
-  for (curr = &m->elems[b]; *curr != NULL; curr = &(*curr)->next) {
-    if (strcmp((*curr)->key, key) == 0) {
+/**
+ * Same as `map_try_get`, for a key of `len` bytes.
+ */
+bool map_try_get_n(const map m, const char *key, size_t len, void **value) {
+  return try_get(m, key, len, hash(m, key, len), value);
+}
 
-      // Bridge the linked list accross the removed element.
-      struct cell *found = *curr;
-      *curr = (*curr)->next;
+/**
+ * Internal helper; implements `map_try_get_n`, given the key's hash `h`.
+ */
+static bool try_get(const map m, const char *key, size_t len, uint64_t h,
+    void **value) {
+  size_t i;
+  struct table *t = find(m, key, len, h, &i);
+  if (t == NULL) return false;
 
-      void *value = found->value;
-      free(found);
-      m->size -= 1;
-      return value;
+  if (value != NULL) *value = table_slot(t, i)->value;
+  return true;
+}
+
+/**
+ * Retrieve the values for many keys in a map at once.
+ * 
+ * For each `i` below `n`, looks up `keys[i]`, and stores whether it was found
+ * in `found[i]` and its value (or NULL, if it was not found) in `values[i]`.
+ * Looking up keys in batches lets the memory accesses for different keys
+ * overlap, which is considerably faster than looking them up one at a time in
+ * maps too large to fit in cache. `found` may be NULL if not needed.
+ */
+void map_get_batch(const map m, const char *const *keys, size_t n,
+    void **values, bool *found) {
+  struct table *t = &m->table;
+  size_t mask = t->capacity - 1;
+
+  for (size_t start = 0; start < n; start += BATCH_SIZE) {
+    size_t count = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+    const char *const *batch = keys + start;
+    size_t lens[BATCH_SIZE];
+    uint64_t hashes[BATCH_SIZE];
+
+    // First, hash every key in the batch, and start loading each key's home
+    // slot and control byte. Also start loading the keys of the next batch,
+    // so that hashing them will not stall either.
+    for (size_t i = 0; i < count; i += 1) {
+      if (start + BATCH_SIZE + i < n) {
+        PREFETCH(batch[BATCH_SIZE + i]);
+      }
+      lens[i] = strlen(batch[i]);
+      hashes[i] = hash(m, batch[i], lens[i]);
+      table_prefetch(t, hashes[i] & mask);
+    }
+
+    // Next, start loading the keys of any home slots that look like a match
+    // but keep their keys out of line, so that the key comparisons below will
+    // not stall.
+    for (size_t i = 0; i < count; i += 1) {
+      size_t b = hashes[i] & mask;
+#ifdef MAP_ROBIN_HOOD
+      if (t->ctrl[b] != rh_ctrl(0)) continue;
+#else
+      if (t->ctrl[b] != CTRL_H2(hashes[i])) continue;
+#endif
+      struct slot *s = table_slot(t, b);
+      if (s->hash == hashes[i] && slot_tag(s) > INLINE_MAX) {
+        PREFETCH(slot_key(s));
+      }
+    }
+
+    // Finally, do the lookups themselves, which should now mostly hit cache.
+    for (size_t i = 0; i < count; i += 1) {
+      void *value = NULL;
+      bool key_found = try_get(m, batch[i], lens[i], hashes[i], &value);
+      values[start + i] = value;
+      if (found != NULL) found[start + i] = key_found;
     }
   }
+}
+
+/**
+ * Remove a key and its value from a map.
+ * 
+ * Crashes if the map does not already contain the key.
+ */
+void *map_remove(map m, const char *key) {
+  return map_remove_n(m, key, strlen(key));
+}
+
+/**
+ * Same as `map_remove`, for a key of `len` bytes.
+ */
+void *map_remove_n(map m, const char *key, size_t len) {
+  void *value;
+  bool key_found = map_try_remove_n(m, key, len, &value);
 
   // Key not found.
-  bool key_found = false;
   assert(key_found);
-  exit(1);
+  if (!key_found) exit(1);
+
+  return value;
 }
 
 /**
- * Get the "first" key (arbitrarily ordered) in a map. If the map is empty,
- * returns NULL.
+ * Remove a key from a map, if it exists.
+ * 
+ * Returns whether the map contained the key. If it did, and `value` is not
+ * NULL, the removed value is stored in `*value`.
  */
-const char *map_first(map m) {
+bool map_try_remove(map m, const char *key, void **value) {
+  return map_try_remove_n(m, key, strlen(key), value);
+}
 
-  // Find and return the first cell in the first non-empty bucket.
-  for (int i = 0; i < m->capacity; i += 1) {
-    if (m->elems[i] != NULL) {
-      return m->elems[i]->key;
-    }
+/**
+ * Same as `map_try_remove`, for a key of `len` bytes.
+ */
+bool map_try_remove_n(map m, const char *key, size_t len, void **value) {
+  uint64_t h = hash(m, key, len);
+  migrate(m, MIGRATE_STEP);
+
+  size_t i;
+  struct table *t = find(m, key, len, h, &i);
+  if (t == NULL) return false;
+
+  struct slot *found = table_slot(t, i);
+  if (value != NULL) *value = found->value;
+  if (slot_tag(found) == KEY_CELL && m->pool == NULL) {
+    arena_free(&m->cells, found->cell,
+        sizeof (struct cell) + found->cell->len + 1);
   }
+  table_erase(t, i);
+  shrink_if_necessary(m);
+  return true;
+}
 
-  return NULL;
+/**
+ * Hash a key of `len` bytes for use with the `_hashed` functions.
+ * 
+ * The hash is keyed with a random seed shared by every map in the process
+ * (except maps created with `map_create_seeded`, which have their own), so
+ * computing it once saves rehashing the key for each map it is looked up in.
+ */
+map_hash_t map_hash_key(const char *key, size_t len) {
+  return hash_with(shared_seed(), key, len);
+}
+
+/**
+ * Variants of `map_get_n`, `map_try_get_n`, and `map_set_n` that take the
+ * key's hash, as computed by `map_hash_key`, instead of computing it again.
+ * 
+ * Maps created with `map_create_seeded` cannot use the precomputed hash, and
+ * instead hash the key themselves.
+ */
+void *map_get_hashed(const map m, const char *key, size_t len,
+    map_hash_t hash) {
+  void *value;
+  bool key_found = try_get(m, key, len, prehashed(m, key, len, hash), &value);
+
+  // Key not found.
+  assert(key_found);
+  if (!key_found) exit(1);
+
+  return value;
+}
+bool map_try_get_hashed(const map m, const char *key, size_t len,
+    map_hash_t hash, void **value) {
+  return try_get(m, key, len, prehashed(m, key, len, hash), value);
+}
+void map_set_hashed(map m, const char *key, size_t len, map_hash_t hash,
+    void *value) {
+  bool inserted;
+  *entry(m, key, len, prehashed(m, key, len, hash), &inserted) = value;
+}
+
+/**
+ * Get the "first" key (arbitrarily ordered, or the oldest key in the compact
+ * layout) in a map. If the map is empty, returns NULL.
+ */
+const char *map_first(map m) {
+  map_iter it = map_iter_start(m);
+  return map_iter_next(&it);
 }
 
 /**
@@ -191,67 +872,940 @@ const char *map_first(map m) {
  */
 const char *map_next(map m, const char *key) {
 
-  // First, get a reference to the current cell and check its successor.
-  struct cell *curr = (void *) (key - sizeof (struct cell));
-  if (curr->next != NULL) {
-    return curr->next->key;
+  // Keys stored inline point into one of the tables' slot arrays, so the slot
+  // holding the current key can be read straight off the pointer.
+  struct table *tables[] = {&m->old, &m->table};
+  for (int j = 0; j < 2; j += 1) {
+    size_t n;
+    uintptr_t base = (uintptr_t) table_array(tables[j], &n);
+    uintptr_t p = (uintptr_t) key;
+    if (p >= base && p < base + n * sizeof (struct slot)) {
+      map_iter it = {m, j, (p - base) / sizeof (struct slot) + 1};
+      return map_iter_next(&it);
+    }
   }
 
-  // If no immediate successor exists, begin searching the rest of the buckets.
-  int b = hash(key) % m->capacity;
-  for (int i = b + 1; i < m->capacity; i += 1) {
-    if (m->elems[i] != NULL) {
-      return m->elems[i]->key;
+  // Otherwise, find the slot by looking the key up. Its length is stored in
+  // the cell just before it, unless the map borrows its keys.
+  size_t len = m->borrow_keys ? strlen(key) :
+      ((struct cell *) (key - offsetof(struct cell, key)))->len;
+  size_t b;
+  struct table *curr = find(m, key, len, hash(m, key, len), &b);
+
+  // Then, continue iterating from the slot after it. In the compact layout,
+  // iteration is over entries rather than slots.
+#ifdef MAP_COMPACT
+  b = curr->index[b];
+#endif
+  map_iter it = {m, curr == &m->old ? 0 : 1, b + 1};
+  return map_iter_next(&it);
+}
+
+/**
+ * Start iterating over a map's keys.
+ * 
+ * Usage:
+ * 
+ * map_iter it = map_iter_start(m);
+ * for (const char *key; (key = map_iter_next(&it)) != NULL;) {
+ *   ...
+ * }
+ * 
+ * Unlike `map_next`, which has to look up the previous key to find where it
+ * left off, an iterator remembers its position, so visiting every key costs
+ * little more than a scan over the map's memory. The map must not be modified
+ * while it is being iterated over.
+ */
+map_iter map_iter_start(map m) {
+
+  // Keys in the old table (if a resize is in progress) are visited first.
+  return (map_iter) {m, 0, 0};
+}
+
+/**
+ * Get the next key from an iterator, or NULL if every key has been visited.
+ */
+const char *map_iter_next(map_iter *it) {
+  struct slot *s = iter_next(it);
+  return s != NULL ? slot_key(s) : NULL;
+}
+
+/**
+ * Get the next entry from an iterator, storing its key, the key's length, and
+ * its value in `*key`, `*len`, and `*value`. Returns false, without storing
+ * anything, if every entry has been visited.
+ * 
+ * This fetches the value along with the key, so no lookup is needed to find
+ * it. `len` and `value` may be NULL if not needed.
+ */
+bool map_iter_next_entry(map_iter *it, const char **key, size_t *len,
+    void **value) {
+  struct slot *s = iter_next(it);
+  if (s == NULL) return false;
+
+  *key = slot_key(s);
+  if (len != NULL) *len = slot_len(s);
+  if (value != NULL) *value = s->value;
+  return true;
+}
+
+/**
+ * Internal helper; advance an iterator to the next occupied slot, returning it,
+ * or NULL if there are no more.
+ */
+static struct slot *iter_next(map_iter *it) {
+  struct table *tables[] = {&it->m->old, &it->m->table};
+  for (; it->table < 2; it->table += 1, it->slot = 0) {
+    struct table *t = tables[it->table];
+#ifdef MAP_COMPACT
+
+    // Visit entries in insertion order, skipping the holes left by removals.
+    for (; it->slot < t->used; it->slot += 1) {
+      if (slot_tag(&t->entries[it->slot]) != KEY_HOLE) {
+        return &t->entries[it->slot++];
+      }
     }
+#else
+    for (; it->slot < t->capacity; it->slot += 1) {
+      if (CTRL_IS_FULL(t->ctrl[it->slot])) {
+        return &t->slots[it->slot++];
+      }
+    }
+#endif
   }
-  
-  // No more keys.
+
+  // No more entries.
   return NULL;
 }
 
 /**
- * Internal helper; hash a string key.
+ * Internal helper; get the array holding a table's slots (which, in the compact
+ * layout, is its entries array), and store its length in `*n`.
+ */
+static struct slot *table_array(const struct table *t, size_t *n) {
+#ifdef MAP_COMPACT
+  *n = t->used;
+  return t->entries;
+#else
+  *n = t->capacity;
+  return t->slots;
+#endif
+}
+
+/**
+ * Internal helper; get the last byte of a slot's inline key buffer, which
+ * tells how its key is stored (see `INLINE_MAX`).
  */
-static unsigned int hash(const char *key) {
-  unsigned int hash = -1;
-  while (*key) {
-    hash *= 31;
-    hash ^= (unsigned char) *key;
-    key += 1;
+static unsigned char slot_tag(const struct slot *s) {
+  return (unsigned char) s->key[INLINE_MAX];
+}
+
+/**
+ * Internal helpers; get the key stored in a slot, and its length.
+ */
+static const char *slot_key(const struct slot *s) {
+  if (slot_tag(s) == KEY_CELL) return s->cell->key;
+  if (slot_tag(s) == KEY_BORROWED) return s->borrowed.key;
+  return s->key;
+}
+static size_t slot_len(const struct slot *s) {
+  if (slot_tag(s) == KEY_CELL) return s->cell->len;
+  if (slot_tag(s) == KEY_BORROWED) return s->borrowed.len;
+  return (size_t) (INLINE_MAX - slot_tag(s));
+}
+
+/**
+ * Internal helper; compute the hash used to place a key of `len` bytes in a
+ * map.
+ */
+static uint64_t hash(const map m, const char *key, size_t len) {
+  return scramble(m, hash_with(m->hash_seed, key, len));
+}
+
+/**
+ * Internal helper; compute the hash used to place a key in a map, given its
+ * hash `h` from `map_hash_key`.
+ */
+static uint64_t prehashed(const map m, const char *key, size_t len,
+    map_hash_t h) {
+  if (m->hash_seed != shared_seed()) return hash(m, key, len);
+  return scramble(m, h);
+}
+
+/**
+ * Internal helper; hash a key of `len` bytes with the given seed.
+ * 
+ * By default this uses `hash_wy`, which reads the key a word at a time. Build
+ * with `-DMAP_HASH_LEGACY` to use the original byte-at-a-time hash instead.
+ */
+static uint64_t hash_with(uint64_t seed, const char *key, size_t len) {
+#ifdef MAP_HASH_LEGACY
+  return hash_legacy(key, len, seed);
+#else
+  return hash_wy(key, len, seed);
+#endif
+}
+
+/**
+ * Internal helper; scramble a key's hash with a map's slot seed.
+ * 
+ * This is a bijection, so two keys have the same scrambled hash exactly when
+ * they have the same hash, and the scrambled hash can stand in for the hash
+ * everywhere within the map. Keys whose hashes agree in their low bits (and so
+ * share a slot) in one map will generally not do so in another.
+ */
+static uint64_t scramble(const map m, uint64_t h) {
+  h = (h ^ m->slot_seed) * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 32);
+}
+
+/**
+ * Internal helper; get the seed shared by maps in this process, generating it
+ * on first use.
+ */
+static uint64_t shared_seed() {
+  pthread_once(&seeds_once, init_seeds);
+  return seeds_shared;
+}
+
+/**
+ * Internal helper; generate a new random seed for a map.
+ * 
+ * The generator is seeded once per process from the operating system (falling
+ * back to the clock and an address, which vary between runs, if that fails).
+ * Successive seeds are then drawn from it with the SplitMix64 generator, whose
+ * state is advanced atomically, so that maps created on different threads at
+ * once still get distinct seeds.
+ */
+static uint64_t random_seed() {
+  pthread_once(&seeds_once, init_seeds);
+  return next_seed();
+}
+
+/**
+ * Internal helper; seed the generator behind `random_seed`, and draw the
+ * shared seed from it. Runs exactly once per process.
+ */
+static void init_seeds() {
+  uint64_t state;
+  FILE *f = fopen("/dev/urandom", "rb");
+  if (f == NULL || fread(&state, sizeof state, 1, f) != 1) {
+    state = (uint64_t) time(NULL) ^ (uint64_t) clock() ^
+        (uint64_t) (uintptr_t) &state;
+  }
+  if (f != NULL) fclose(f);
+  atomic_store_explicit(&seeds_state, state, memory_order_relaxed);
+  seeds_shared = next_seed();
+}
+
+/**
+ * Internal helper; draw the next seed from the generator behind
+ * `random_seed`.
+ */
+static uint64_t next_seed() {
+  uint64_t z = atomic_fetch_add_explicit(&seeds_state,
+      0x9e3779b97f4a7c15ull, memory_order_relaxed) + 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Internal helpers; the default allocator, which uses the C library.
+ */
+static void *default_alloc(void *ctx, size_t size) {
+  (void) ctx;
+  return malloc(size);
+}
+static void *default_realloc(void *ctx, void *block, size_t old_size,
+    size_t new_size) {
+  (void) ctx;
+  (void) old_size;
+  return realloc(block, new_size);
+}
+static void default_free(void *ctx, void *block, size_t size) {
+  (void) ctx;
+  (void) size;
+  free(block);
+}
+
+/**
+ * Internal helper; create a map with the given seeds and options.
+ */
+static map create(uint64_t hash_seed, uint64_t slot_seed,
+    const struct map_config *config) {
+  const struct map_allocator *allocator = config->allocator != NULL ?
+      config->allocator : &default_allocator;
+  double max_load = config->max_load != 0 ? config->max_load :
+      DEFAULT_MAX_LOAD;
+  bool valid = max_load >= MIN_MAX_LOAD && max_load < 1;
+  assert(valid);
+  if (!valid) exit(1);
+
+  // Keys can only be shared through a map created by `map_create_pool`.
+  valid = config->pool == NULL || config->pool->pool == config->pool;
+  assert(valid);
+  if (!valid) exit(1);
+
+  // A map that borrows its keys has none to share.
+  valid = !config->borrow_keys || config->pool == NULL;
+  assert(valid);
+  if (!valid) exit(1);
+
+  // Allocate space for the map's primary data structure. More space will be 
+  // allocated in the future when values are added to the map.
+  map m = allocator->alloc(allocator->ctx, sizeof (struct map));
+  assert(m != NULL);
+  m->allocator = *allocator;
+  m->max_load = max_load;
+  m->pool = config->pool;
+  m->borrow_keys = config->borrow_keys;
+  table_init(m, &m->table, capacity_for(m, config->capacity));
+
+  // Initialize metadata.
+  m->old = (struct table) {0};
+  m->migrated = 0;
+  arena_init(&m->cells, &m->allocator);
+  m->hash_seed = hash_seed;
+  m->slot_seed = slot_seed;
+  m->incremental = config->incremental_resize;
+
+  return m;
+}
+
+/**
+ * Internal helper; get the smallest capacity whose table can hold `n` keys
+ * without growing (see `extend_if_necessary`).
+ */
+static size_t capacity_for(const map m, size_t n) {
+  size_t capacity = MIN_CAPACITY;
+  while (load_limit(m, capacity) < n) {
+
+    // Sizes this large could never be allocated, so treat them as allocation
+    // failures rather than letting the capacity wrap around.
+    bool valid = capacity <= SIZE_MAX / 2 / sizeof (struct slot);
+    assert(valid);
+    if (!valid) exit(1);
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+/**
+ * Internal helper; get the number of slots of a table with the given capacity
+ * that may be used before it must grow, which always leaves at least one slot
+ * empty.
+ */
+static size_t load_limit(const map m, size_t capacity) {
+  size_t limit = (size_t) (capacity * m->max_load);
+  return limit < capacity ? limit : capacity - 1;
+}
+
+/**
+ * Internal helper; determine whether a new key of `len` bytes is stored in a
+ * cell from a map's own arena: a long key, or any key in a pool. Keys of maps
+ * that use a pool are stored in the pool's cells instead.
+ */
+static bool owns_cell(const map m, size_t len) {
+  if (m->borrow_keys) return false;
+  if (m->pool != NULL) return m->pool == m;
+  return len > INLINE_MAX;
+}
+
+/**
+ * Internal helper; get the cell holding a pool's copy of a key, adding it if
+ * necessary.
+ */
+static struct cell *intern(map pool, const char *key, size_t len) {
+  assert(pool->pool == pool);
+  bool inserted;
+  char *value = (char *) entry(pool, key, len, hash(pool, key, len), &inserted);
+  return ((struct slot *) (value - offsetof(struct slot, value)))->cell;
+}
+
+/**
+ * Internal helper; allocate an empty table with the given capacity, which must
+ * be a power of two.
+ */
+static void table_init(map m, struct table *t, size_t capacity) {
+  struct map_allocator *a = &m->allocator;
+  size_t ctrl_size = capacity + GROUP_WIDTH - 1;
+  t->ctrl = a->alloc(a->ctx, ctrl_size * sizeof (unsigned char));
+  assert(t->ctrl != NULL);
+  memset(t->ctrl, CTRL_EMPTY, ctrl_size * sizeof (unsigned char));
+#ifdef MAP_COMPACT
+
+  // Entries are allocated as keys are added (see `table_reserve`).
+  assert(capacity - 1 <= UINT32_MAX);
+  t->index = a->alloc(a->ctx, capacity * sizeof (uint32_t));
+  assert(t->index != NULL);
+  t->entries = NULL;
+  t->used = 0;
+  t->room = 0;
+#else
+  t->slots = a->alloc(a->ctx, capacity * sizeof (struct slot));
+  assert(t->slots != NULL);
+#endif
+  t->capacity = capacity;
+  t->size = 0;
+  t->deleted = 0;
+  t->limit = load_limit(m, capacity);
+}
+
+/**
+ * Internal helper; free a table's memory. Does nothing for a table with zero
+ * capacity.
+ */
+static void table_free(map m, struct table *t) {
+  if (t->capacity == 0) return;
+  struct map_allocator *a = &m->allocator;
+  a->free(a->ctx, t->ctrl,
+      (t->capacity + GROUP_WIDTH - 1) * sizeof (unsigned char));
+#ifdef MAP_COMPACT
+  a->free(a->ctx, t->index, t->capacity * sizeof (uint32_t));
+  if (t->room > 0) {
+    a->free(a->ctx, t->entries, t->room * sizeof (struct slot));
   }
-  return hash;
+#else
+  a->free(a->ctx, t->slots, t->capacity * sizeof (struct slot));
+#endif
+  *t = (struct table) {0};
+}
+
+/**
+ * Internal helper; make room in a table's entries array for `n` entries in
+ * total, which must be no more than the table can hold without growing. The
+ * array grows by half again each time, so appending is amortized constant
+ * time. Does nothing in the default layout, which has no entries array.
+ */
+static void table_reserve(map m, struct table *t, size_t n) {
+#ifdef MAP_COMPACT
+  if (n <= t->room) return;
+
+  size_t room = t->room + t->room / 2;
+  if (room < MIN_CAPACITY) room = MIN_CAPACITY;
+  if (room < n) room = n;
+  if (room > t->limit) room = t->limit;
+  assert(room >= n);
+
+  struct map_allocator *a = &m->allocator;
+  size_t bytes = room * sizeof (struct slot);
+  t->entries = t->room == 0 ? a->alloc(a->ctx, bytes) :
+      a->realloc(a->ctx, t->entries, t->room * sizeof (struct slot), bytes);
+  assert(t->entries != NULL);
+  t->room = room;
+#else
+  (void) m;
+  (void) t;
+  (void) n;
+#endif
+}
+
+/**
+ * Internal helper; get the slot stored for full slot `i` of a table.
+ */
+static struct slot *table_slot(const struct table *t, size_t i) {
+#ifdef MAP_COMPACT
+  return &t->entries[t->index[i]];
+#else
+  return &t->slots[i];
+#endif
+}
+
+/**
+ * Internal helper; start loading slot `i` of a table, and its control byte.
+ * In the compact layout, the slot's entry cannot be located until its index
+ * has been loaded, so only the index is prefetched.
+ */
+static void table_prefetch(const struct table *t, size_t i) {
+  PREFETCH(&t->ctrl[i]);
+#ifdef MAP_COMPACT
+  PREFETCH(&t->index[i]);
+#else
+  PREFETCH(&t->slots[i]);
+#endif
+}
+
+#ifdef MAP_ROBIN_HOOD
+/**
+ * Internal helper; get the control byte for a slot with the given probe
+ * distance (how many slots it sits past its key's home slot). Control bytes
+ * saturate at `CTRL_FAR`, so the distances of far slots have to be recomputed
+ * from their cached hashes.
+ */
+static unsigned char rh_ctrl(size_t dist) {
+  return dist + 1 < CTRL_FAR ? (unsigned char) (dist + 1) : CTRL_FAR;
+}
+
+/**
+ * Internal helper; move the entry in full slot `from` of a table to empty slot
+ * `to`, updating its probe distance.
+ */
+static void table_move(struct table *t, size_t from, size_t to) {
+  size_t dist = (to - table_slot(t, from)->hash) & (t->capacity - 1);
+#ifdef MAP_COMPACT
+  t->index[to] = t->index[from];
+#else
+  t->slots[to] = t->slots[from];
+#endif
+  t->ctrl[to] = rh_ctrl(dist);
+  t->ctrl[from] = CTRL_EMPTY;
+}
+
+/**
+ * Internal helper; find the slot holding a key of `len` bytes within a table,
+ * given the key's hash `h`. Returns `NOT_FOUND` if the key is not in the
+ * table, in which case `*vacant` is set to the slot where the key should be
+ * inserted.
+ * 
+ * Robin Hood hashing keeps the entries along any probe sequence ordered by
+ * their home slots, so a search stops as soon as it reaches an entry closer to
+ * its home than the key would be to its own. That entry's slot is where the
+ * key belongs.
+ */
+static size_t table_probe(const struct table *t, const char *key, size_t len,
+    uint64_t h, size_t *vacant) {
+  size_t mask = t->capacity - 1;
+  size_t i = h & mask;
+  for (size_t dist = 0;; dist += 1, i = (i + 1) & mask) {
+    unsigned char want = rh_ctrl(dist);
+    if (t->ctrl[i] < want) {
+      *vacant = i;
+      return NOT_FOUND;
+    }
+
+    // An entry at the same distance shares the key's home slot, so only those
+    // entries (or, past `CTRL_FAR`, any far entry) can hold the key.
+    if (t->ctrl[i] == want) {
+      struct slot *s = table_slot(t, i);
+      if (s->hash == h && slot_len(s) == len &&
+          (slot_key(s) == key || memcmp(slot_key(s), key, len) == 0)) {
+        return i;
+      }
+    }
+  }
+}
+
+/**
+ * Internal helper; copy a slot into slot `i` of a table, where its key belongs
+ * (see `table_probe`), returning the copy. In the compact layout, the table
+ * must have room for another entry (see `table_reserve`).
+ */
+static struct slot *table_place(struct table *t, size_t i,
+    const struct slot *s) {
+  size_t mask = t->capacity - 1;
+
+  // Make room by shifting the run of entries starting at `i` one slot along,
+  // which keeps them in order. The table always has an empty slot to end the
+  // run.
+  size_t end = i;
+  while (t->ctrl[end] != CTRL_EMPTY) {
+    end = (end + 1) & mask;
+  }
+  for (size_t j = end; j != i; j = (j - 1) & mask) {
+    table_move(t, (j - 1) & mask, j);
+  }
+
+  t->ctrl[i] = rh_ctrl((i - s->hash) & mask);
+#ifdef MAP_COMPACT
+  assert(t->used < t->room);
+  t->index[i] = t->used;
+  t->used += 1;
+#endif
+  t->size += 1;
+
+  // In the compact layout, `s` may already be this entry, when a rebuild puts
+  // an entry back in place. Assigning an object to itself is still well
+  // defined.
+  struct slot *dst = table_slot(t, i);
+  *dst = *s;
+  return dst;
+}
+
+/**
+ * Internal helper; copy a slot into a table. Its key must not already be in
+ * the table, and the table must have room for it.
+ */
+static void table_insert(struct table *t, const struct slot *s) {
+  size_t mask = t->capacity - 1;
+  size_t i = s->hash & mask;
+  for (size_t dist = 0; t->ctrl[i] >= rh_ctrl(dist); dist += 1) {
+    i = (i + 1) & mask;
+  }
+  table_place(t, i, s);
+}
+
+/**
+ * Internal helper; remove the entry in slot `i` of a table. This does not free
+ * the cell holding the entry's key, if it has one.
+ */
+static void table_erase(struct table *t, size_t i) {
+  size_t mask = t->capacity - 1;
+#ifdef MAP_COMPACT
+
+  // The entry's hole in the entries array is only reclaimed by a rebuild, so
+  // it counts against the table's load as a deleted slot until then.
+  table_slot(t, i)->key[INLINE_MAX] = (char) KEY_HOLE;
+  t->deleted += 1;
+#endif
+
+  // Shift each following entry that is not in its home slot back by one, so
+  // that no tombstone is needed to keep probe sequences intact.
+  t->ctrl[i] = CTRL_EMPTY;
+  for (size_t j = (i + 1) & mask; t->ctrl[j] > rh_ctrl(0);
+      j = (j + 1) & mask) {
+    table_move(t, j, (j - 1) & mask);
+  }
+  t->size -= 1;
+}
+
+#else
+/**
+ * Internal helper; set the control byte of slot `i` of a table, along with its
+ * mirrors past the end of the table. A table smaller than a group mirrors some
+ * slots more than once.
+ */
+static void table_set_ctrl(struct table *t, size_t i, unsigned char c) {
+  t->ctrl[i] = c;
+  for (size_t j = i + t->capacity; j < t->capacity + GROUP_WIDTH - 1;
+      j += t->capacity) {
+    t->ctrl[j] = c;
+  }
+}
+
+/**
+ * Internal helpers; load the group of control bytes starting at `ctrl`, and
+ * find the slots in a group whose control bytes equal `c`, or that are free
+ * (empty or deleted).
+ */
+#if defined(__SSE2__) && !defined(MAP_NO_SIMD)
+static group group_load(const unsigned char *ctrl) {
+  return _mm_loadu_si128((const __m128i *) ctrl);
+}
+static group_mask group_match(group g, unsigned char c) {
+  __m128i eq = _mm_cmpeq_epi8(g, _mm_set1_epi8((char) c));
+  return (group_mask) _mm_movemask_epi8(eq);
+}
+static group_mask group_free(group g) {
+  return (group_mask) _mm_movemask_epi8(g);
+}
+#else
+static group group_load(const unsigned char *ctrl) {
+
+  // Assembling the group a byte at a time puts slot `k` in byte `k` whatever
+  // the machine's byte order. Compilers turn this into a single load.
+  group g = 0;
+  for (int k = 0; k < GROUP_WIDTH; k += 1) {
+    g |= (group) ctrl[k] << (8 * k);
+  }
+  return g;
+}
+static group_mask group_match(group g, unsigned char c) {
+
+  // Bytes equal to `c` become zero. Adding 0x7f to the low 7 bits of a byte
+  // sets its high bit unless they are all zero, which detects zero bytes
+  // exactly, unlike the usual subtraction trick.
+  const uint64_t lows = 0x7f7f7f7f7f7f7f7full;
+  uint64_t x = g ^ (0x0101010101010101ull * c);
+  return ~(((x & lows) + lows) | x) & ~lows;
+}
+static group_mask group_free(group g) {
+  return g & 0x8080808080808080ull;
+}
+#endif
+
+/**
+ * Internal helper; get the position within its group of the first slot in a
+ * nonzero group mask.
+ */
+static size_t group_first(group_mask bits) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (size_t) __builtin_ctzll(bits) >> GROUP_SHIFT;
+#else
+  size_t n = 0;
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    n += 1;
+  }
+  return n >> GROUP_SHIFT;
+#endif
+}
+
+/**
+ * Internal helper; find the slot holding a key of `len` bytes within a table,
+ * given the key's hash `h`. Returns `NOT_FOUND` if the key is not in the
+ * table, in which case `*vacant` is set to the slot where the key should be
+ * inserted.
+ */
+static size_t table_probe(const struct table *t, const char *key, size_t len,
+    uint64_t h, size_t *vacant) {
+  size_t mask = t->capacity - 1;
+  unsigned char h2 = CTRL_H2(h);
+  *vacant = NOT_FOUND;
+
+  // Probe linearly from the key's home slot, a group of slots at a time. A
+  // table is never allowed to fill up completely, so an empty slot always
+  // terminates the search. Only slots whose control bytes match the key's hash
+  // fragment are read, and keys are only compared when the cached hashes
+  // match too.
+  for (size_t i = h & mask;; i = (i + GROUP_WIDTH) & mask) {
+    group g = group_load(&t->ctrl[i]);
+    for (group_mask bits = group_match(g, h2); bits != 0; bits &= bits - 1) {
+      size_t j = (i + group_first(bits)) & mask;
+      struct slot *s = table_slot(t, j);
+      if (s->hash == h && slot_len(s) == len &&
+          (slot_key(s) == key || memcmp(slot_key(s), key, len) == 0)) {
+        return j;
+      }
+    }
+
+    // Slots left behind by removed keys can be reused for insertion, but the
+    // key may still be present further along the probe sequence. The compact
+    // layout never reuses them, since each one stands for a hole in its
+    // entries array that is only reclaimed by a rebuild.
+    group_mask empty = group_match(g, CTRL_EMPTY);
+    if (*vacant == NOT_FOUND) {
+      group_mask avail = COMPACT ? empty : group_free(g);
+      if (avail != 0) *vacant = (i + group_first(avail)) & mask;
+    }
+    if (empty != 0) return NOT_FOUND;
+  }
+}
+
+/**
+ * Internal helper; copy a slot into free slot `i` of a table, returning the
+ * copy. In the compact layout, the table must have room for another entry (see
+ * `table_reserve`).
+ */
+static struct slot *table_place(struct table *t, size_t i,
+    const struct slot *s) {
+  if (t->ctrl[i] == CTRL_DELETED) {
+    t->deleted -= 1;
+  }
+  table_set_ctrl(t, i, CTRL_H2(s->hash));
+#ifdef MAP_COMPACT
+  assert(t->used < t->room);
+  t->index[i] = t->used;
+  t->used += 1;
+#endif
+  t->size += 1;
+
+  // In the compact layout, `s` may already be this entry, when a rebuild puts
+  // an entry back in place. Assigning an object to itself is still well
+  // defined.
+  struct slot *dst = table_slot(t, i);
+  *dst = *s;
+  return dst;
+}
+
+/**
+ * Internal helper; copy a slot into a table. Its key must not already be in
+ * the table, and the table must have room for it.
+ */
+static void table_insert(struct table *t, const struct slot *s) {
+  size_t mask = t->capacity - 1;
+  size_t i = s->hash & mask;
+
+  // Since the key is known not to be in the table, it can go in the first
+  // free slot along its probe sequence.
+  group_mask avail;
+  while ((avail = group_free(group_load(&t->ctrl[i]))) == 0) {
+    i = (i + GROUP_WIDTH) & mask;
+  }
+  table_place(t, (i + group_first(avail)) & mask, s);
+}
+
+/**
+ * Internal helper; remove the entry in slot `i` of a table. This does not free
+ * the cell holding the entry's key, if it has one.
+ */
+static void table_erase(struct table *t, size_t i) {
+
+  // Leave a tombstone behind so that probe sequences passing through this slot
+  // continue on to any keys stored after it.
+#ifdef MAP_COMPACT
+  table_slot(t, i)->key[INLINE_MAX] = (char) KEY_HOLE;
+#endif
+  table_set_ctrl(t, i, CTRL_DELETED);
+  t->size -= 1;
+  t->deleted += 1;
+}
+#endif
+
+/**
+ * Internal helper; find the slot holding a key of `len` bytes within a table,
+ * given the key's hash `h`. Returns `NOT_FOUND` if the key is not in the
+ * table.
+ */
+static size_t table_find(const struct table *t, const char *key, size_t len,
+    uint64_t h) {
+  size_t vacant;
+  return table_probe(t, key, len, h, &vacant);
+}
+
+/**
+ * Internal helper; find the table and slot `*i` holding a key of `len` bytes,
+ * given the key's hash `h`. Returns NULL if the key is not in the map.
+ */
+static struct table *find(const map m, const char *key, size_t len,
+    uint64_t h, size_t *i) {
+  *i = table_find(&m->table, key, len, h);
+  if (*i != NOT_FOUND) return &m->table;
+
+  if (m->old.size > 0) {
+    *i = table_find(&m->old, key, len, h);
+    if (*i != NOT_FOUND) return &m->old;
+  }
+  return NULL;
 }
 
 /*
- * Grow the capacity of the hash map by a factor of two, only when the map's 
- * load becomes greater than one.
+ * Make room for one more entry. The table is grown by a factor of two once it
+ * reaches its maximum load (see `load_limit`), counting tombstones, which also
+ * lengthen probe sequences. If most of that load is tombstones, the table is
+ * instead rebuilt at its current capacity to clear them out. Returns true if
+ * the table was rebuilt.
  */
-static void extend_if_necessary(map m) {
-  if (m->size == m->capacity) {
+static bool extend_if_necessary(map m) {
+  struct table *t = &m->table;
+
+  // Entries still waiting in the old table during a resize count towards the
+  // load, so that there is always room to finish moving them.
+  size_t size = t->size + m->old.size;
+  if (size + t->deleted + 1 > t->limit) {
 
-    // Save old values first, since all map entries will need to be copied over.
-    int capacity = m->capacity;
-    struct cell **elems = m->elems;
+    // A resize in progress always finishes well before the new table fills
+    // up, but finish it here regardless before starting another.
+    migrate(m, (size_t) -1);
 
     // Doubling the capacity when necessary allows for an amortized constant 
     // runtime for extension.
-    m->capacity *= 2;
-    m->elems = calloc(m->capacity, sizeof (struct cell *));
+    if (size * 2 >= t->limit) {
+      resize(m, t->capacity * 2);
+    } else {
+      resize(m, t->capacity);
+    }
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Give memory back once a map becomes mostly empty. The table is shrunk once
+ * it falls below 1/7 of its maximum load (1/8 full by default), to a capacity
+ * at which it is at most half of that load. That leaves a wide margin on both
+ * sides before the next shrink or the next growth, so a map cannot thrash
+ * between the two.
+ */
+static void shrink_if_necessary(map m) {
+  struct table *t = &m->table;
+  if (m->old.capacity == 0 && t->capacity > MIN_CAPACITY &&
+      t->size * 7 < t->limit) {
+    resize(m, capacity_for(m, t->size * 2));
+  }
+}
 
-    for (int i = 0; i < capacity; i += 1) {
-      struct cell *curr = elems[i];
-      while (curr != NULL) {
-        struct cell *next = curr->next;
+/**
+ * Internal helper; start moving every entry into a fresh table of the given
+ * capacity, which must be a power of two. Unless the map resizes
+ * incrementally, this completes the move immediately.
+ * 
+ * The compact layout instead keeps its entries array, squeezing out any holes
+ * in place, and rebuilds the index around it all at once. Entries keep their
+ * insertion order, and the rebuild only reads the array sequentially, so it
+ * never needs to be spread out across later operations.
+ */
+static void resize(map m, size_t capacity) {
+#ifdef MAP_COMPACT
+  struct table *t = &m->table;
+  struct slot *entries = t->entries;
+  size_t used = t->used;
+  size_t room = t->room;
+  t->room = 0;
+  table_free(m, t);
+  table_init(m, t, capacity);
+  t->entries = entries;
+  t->room = room;
 
-        // Move the entry from the old data structure to the new.
-        int b = hash(curr->key) % m->capacity;
-        curr->next = m->elems[b];
-        m->elems[b] = curr;
+  // Each live entry is reinserted at or before its current position, so the
+  // array can be compacted as the index is rebuilt.
+  for (size_t j = 0; j < used; j += 1) {
+    if (slot_tag(&entries[j]) != KEY_HOLE) {
+      table_insert(t, &entries[j]);
+    }
+  }
 
-        curr = next;
-      }
+  // Give back any room beyond what the new capacity can ever hold.
+  if (room > t->limit) {
+    struct map_allocator *a = &m->allocator;
+    t->entries = a->realloc(a->ctx, entries, room * sizeof (struct slot),
+        t->limit * sizeof (struct slot));
+    assert(t->entries != NULL);
+    t->room = t->limit;
+  }
+#else
+  table_free(m, &m->old);
+  m->old = m->table;
+  m->migrated = 0;
+  table_init(m, &m->table, capacity);
+
+  if (!m->incremental) {
+    migrate(m, (size_t) -1);
+  }
+#endif
+}
+
+/**
+ * Internal helper; move entries from the old table to the new one, examining
+ * at most `budget` slots of the old table. Once every slot has been examined,
+ * the old table is freed.
+ */
+static void migrate(map m, size_t budget) {
+  struct table *old = &m->old;
+  if (old->capacity == 0) return;
+
+  for (; budget > 0 && m->migrated < old->capacity; budget -= 1) {
+    size_t i = m->migrated;
+    if (CTRL_IS_FULL(old->ctrl[i])) {
+
+      // Move the entry from the old table to the new, reusing its cached hash.
+      // Keys are known to be unique, so there is no need to compare against
+      // existing entries.
+      table_insert(&m->table, table_slot(old, i));
+      table_erase(old, i);
     }
 
-    free(elems);
+    // With Robin Hood hashing, removing an entry shifts the next one back into
+    // its slot, so only move on once the slot is left empty.
+    if (!CTRL_IS_FULL(old->ctrl[i])) {
+      m->migrated += 1;
+    }
+  }
+
+  if (m->migrated == old->capacity) {
+    table_free(m, old);
   }
 }
+
+/**
+ * Internal helper; copy every cell of a map into a fresh arena, then
+ * free the old arena. Cells too large for the arena's chunks already have
+ * allocations of their own, which the new arena takes over in place.
+ */
+static void compact_cells(map m) {
+  struct arena cells;
+  arena_init_compacted(&cells, &m->cells);
+
+  map_iter it = map_iter_start(m);
+  for (struct slot *s; (s = iter_next(&it)) != NULL;) {
+    if (slot_tag(s) != KEY_CELL) continue;
+    size_t size = sizeof (struct cell) + s->cell->len + 1;
+    if (arena_block_size(size) > ARENA_MAX_SMALL) continue;
+    struct cell *cell = arena_alloc(&cells, size);
+    memcpy(cell, s->cell, size);
+    s->cell = cell;
+  }
+
+  arena_destroy(&m->cells);
+  m->cells = cells;
+}
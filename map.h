@@ -2,6 +2,8 @@
 #define __MAP_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Hash map implementation for C.
@@ -14,14 +16,154 @@
  */
 typedef struct map *map;
 
+/**
+ * The hash of a key, as computed by `map_hash_key`.
+ */
+typedef uint64_t map_hash_t;
+
+/**
+ * Memory allocation callbacks for a map.
+ * 
+ * Each callback receives the `ctx` pointer given alongside it, so that a
+ * client can direct a map's memory to a particular pool (for example, a
+ * per-thread arena or huge-page backed memory). Both the map's tables and the
+ * storage for its keys are allocated through these callbacks.
+ * 
+ * - `alloc` returns a new block of at least `size` bytes, aligned for any
+ *   type, or NULL on failure.
+ * - `realloc` resizes a block from `old_size` to `new_size` bytes, returning
+ *   the (possibly moved) block, or NULL on failure.
+ * - `free` releases a block of `size` bytes.
+ */
+struct map_allocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *block, size_t old_size, size_t new_size);
+  void (*free)(void *ctx, void *block, size_t size);
+  void *ctx;
+};
+
 /**
  * Create a new, empty map.
  * 
  * The returned map has dynamically allocated memory associated with it, and
  * this memory must be reclaimed after use with `map_destroy`.
+ * 
+ * Keys are hashed with a random seed, so that keys which collide in one run of
+ * a program will not predictably collide in another, and each map places the
+ * hashes in its slots with its own random seed on top of that. This keeps
+ * lookups fast even when keys come from an untrusted source that might try to
+ * force collisions.
  */
 map map_create();
 
+/**
+ * Create a new, empty map whose hash function is keyed with a given seed.
+ * 
+ * Maps created with the same seed lay out the same keys identically, which is
+ * useful for reproducing iteration order between runs. Seeds should be chosen
+ * randomly when keys may come from an untrusted source. Since such a map does
+ * not use the shared seed, it cannot reuse hashes from `map_hash_key`.
+ */
+map map_create_seeded(uint64_t seed);
+
+/**
+ * Create a new, empty map with room for at least `n` keys.
+ * 
+ * Adding up to `n` keys to the returned map will not cause it to grow, so a map
+ * whose final size is known up front can be filled without ever moving its
+ * entries.
+ */
+map map_create_with_capacity(size_t n);
+
+/**
+ * Create a new, empty map that allocates all of its memory with the given
+ * callbacks.
+ * 
+ * The callbacks are copied into the map, but `allocator->ctx` must remain
+ * valid until the map is destroyed.
+ */
+map map_create_with_allocator(const struct map_allocator *allocator);
+
+/**
+ * Options for `map_create_with_config`. A zero field selects the default, so a
+ * zero-initialized config creates the same map as `map_create`.
+ * 
+ * - `capacity`: make room for at least this many keys up front, as with
+ *   `map_create_with_capacity`.
+ * - `max_load`: the fraction of the table's slots that may be used before it
+ *   grows, from 0.125 up to (but excluding) 1. Higher loads save memory at the
+ *   cost of longer probes, which mostly slow down lookups of missing keys. The
+ *   map shrinks once it falls below 1/7 of this load. Defaults to 0.875, or
+ *   0.9 in maps built with `-DMAP_ROBIN_HOOD`.
+ * - `allocator`: allocate all memory with these callbacks, as with
+ *   `map_create_with_allocator`.
+ * - `incremental_resize`: see `map_set_incremental_resize`.
+ * - `pool`: store keys in this pool (see `map_create_pool`) rather than
+ *   copying them into the map, which then keeps only a pointer to each key.
+ *   The pool must outlive the map.
+ * - `borrow_keys`: store the caller's pointer to each key rather than copying
+ *   the key, so that adding a key allocates nothing for it. Each key must stay
+ *   valid and unchanged for as long as it is in the map, and keys returned by
+ *   the map are the caller's own pointers. Keys may be at most 4 GiB long.
+ *   Cannot be combined with `pool`.
+ */
+struct map_config {
+  size_t capacity;
+  double max_load;
+  const struct map_allocator *allocator;
+  bool incremental_resize;
+  map pool;
+  bool borrow_keys;
+};
+
+/**
+ * Create a new, empty map with the given options.
+ * 
+ * The config is only read during this call.
+ */
+map map_create_with_config(const struct map_config *config);
+
+/**
+ * Create a new, empty pool of interned strings, for sharing key storage
+ * between maps created with it as their `pool` (see `struct map_config`).
+ * 
+ * A pool is itself a map, whose keys are the strings interned in it. Each
+ * string is stored only once, however many maps use it as a key, and stays at
+ * the same address until the pool is destroyed with `map_destroy`, even if it
+ * is removed from the pool. Keys returned by a map that uses a pool are the
+ * pool's copies.
+ * 
+ * The pool is created with the given options, as for `map_create_with_config`,
+ * or the defaults if `config` is NULL. Its `pool` must be NULL, and it must
+ * not set `borrow_keys`, since a pool always holds its own copy of each
+ * string.
+ */
+map map_create_pool(const struct map_config *config);
+
+/**
+ * Get the copy of a string stored in a pool, adding it if necessary.
+ * 
+ * Since a pool holds one copy of each string, interned strings are equal
+ * exactly when their pointers are. Maps that use the pool compare keys by
+ * pointer before comparing their bytes, so looking up a key by its interned
+ * copy never reads the key itself.
+ */
+const char *map_intern(map pool, const char *key);
+
+/**
+ * Same as `map_intern`, for a key of `len` bytes.
+ */
+const char *map_intern_n(map pool, const char *key, size_t len);
+
+/**
+ * Create a new map holding `n` keys and their values.
+ * 
+ * Equivalent to creating a map and calling `map_set_batch` on it, but the map
+ * is created at its final size.
+ */
+map map_build(const char *const *keys, const size_t *lens,
+    void *const *values, size_t n);
+
 /**
  * Free the memory used for a map after use.
  * 
@@ -36,6 +178,47 @@ void map_destroy(map m);
  */
 int map_size(const map m);
 
+/**
+ * Make room in a map for at least `n` keys in total.
+ * 
+ * After this call, the map will not need to grow again until it holds more
+ * than `n` keys. This never shrinks a map.
+ */
+void map_reserve(map m, size_t n);
+
+/**
+ * Shrink a map's memory to fit its current keys.
+ * 
+ * Maps shrink on their own once removals leave them mostly empty, but only
+ * after a wide margin, so that a map whose size hovers around a threshold does
+ * not repeatedly grow and shrink. This call shrinks a map's table as far as
+ * possible immediately, which is useful once a map is known to have reached
+ * its long-term size. Memory for long keys is otherwise only given back when
+ * the map is destroyed, so if most of it has been freed, the remaining keys
+ * are also copied into fresh storage. Pools never move their strings, so they
+ * keep this memory until they are destroyed.
+ */
+void map_shrink_to_fit(map m);
+
+/**
+ * Choose whether a map grows incrementally.
+ * 
+ * By default, a map that runs out of room moves all of its entries into a
+ * larger table at once, so the insertion that triggers growth takes time
+ * proportional to the size of the map. With incremental resizing enabled, the
+ * old and new tables instead coexist while entries are moved across a bounded
+ * number of slots at a time, during each later `map_set` and `map_remove`.
+ * This bounds the work of moving entries in every operation, at the price of
+ * lookups checking both tables while a resize is in progress. The operation
+ * that finishes the move still frees the old table in a single call to the
+ * allocator, which can take time proportional to the table's size for large
+ * maps.
+ * 
+ * Maps built with `-DMAP_COMPACT` always resize at once, so for them this
+ * has no effect.
+ */
+void map_set_incremental_resize(map m, bool enabled);
+
 /**
  * Determine whether a map contains a given key.
  * 
@@ -51,6 +234,38 @@ bool map_contains(const map m, const char *key);
  */
 void map_set(map m, const char *key, void *value);
 
+/**
+ * Set the values for many keys in a map at once.
+ * 
+ * For each `i` below `n`, sets the value for key `keys[i]` to `values[i]`, as
+ * though by `map_set_n`. Each key is `lens[i]` bytes long, or if `lens` is
+ * NULL, a NUL-terminated string. If a key appears more than once, the last
+ * value wins.
+ * 
+ * The map is grown once up front, storage for all of the new keys is
+ * allocated as a single block, and keys are inserted in batches whose memory
+ * accesses overlap, so this is considerably faster than setting the keys one
+ * at a time. Both the map and the key storage are sized as though all `n`
+ * keys were new, so when most of them are already present, setting them one at
+ * a time avoids growing the map for nothing.
+ */
+void map_set_batch(map m, const char *const *keys, const size_t *lens,
+    void *const *values, size_t n);
+
+/**
+ * Find or add the entry for a given key within a map, and get a pointer to its
+ * value.
+ * 
+ * If the key is not already in the map, it is added with a NULL value, and
+ * `*inserted` is set to true; otherwise `*inserted` is set to false. Either
+ * way, the key is only hashed and looked up once, so reading and updating a
+ * value through the returned pointer (for example, incrementing a counter) is
+ * cheaper than separate calls to `map_contains`, `map_get`, and `map_set`.
+ * 
+ * The returned pointer is only valid until the map is next modified.
+ */
+void **map_entry(map m, const char *key, bool *inserted);
+
 /**
  * Retrieve the value for a given key in a map.
  * 
@@ -58,6 +273,27 @@ void map_set(map m, const char *key, void *value);
  */
 void *map_get(const map m, const char *key);
 
+/**
+ * Retrieve the value for a given key in a map, if it exists.
+ * 
+ * Returns whether the map contains the key. If it does, and `value` is not
+ * NULL, the key's value is stored in `*value`. This needs only one lookup,
+ * unlike calling `map_contains` before `map_get`.
+ */
+bool map_try_get(const map m, const char *key, void **value);
+
+/**
+ * Retrieve the values for many keys in a map at once.
+ * 
+ * For each `i` below `n`, looks up `keys[i]`, and stores whether it was found
+ * in `found[i]` and its value (or NULL, if it was not found) in `values[i]`.
+ * Looking up keys in batches lets the memory accesses for different keys
+ * overlap, which is considerably faster than looking them up one at a time in
+ * maps too large to fit in cache. `found` may be NULL if not needed.
+ */
+void map_get_batch(const map m, const char *const *keys, size_t n,
+    void **values, bool *found);
+
 /**
  * Remove a key and return its value from a map.
  * 
@@ -65,6 +301,54 @@ void *map_get(const map m, const char *key);
  */
 void *map_remove(map m, const char *key);
 
+/**
+ * Remove a key from a map, if it exists.
+ * 
+ * Returns whether the map contained the key. If it did, and `value` is not
+ * NULL, the removed value is stored in `*value`.
+ */
+bool map_try_remove(map m, const char *key, void **value);
+
+/**
+ * Variants of the functions above that take a key as `len` bytes starting at
+ * `key`, rather than as a NUL-terminated string.
+ * 
+ * Such keys need not be NUL-terminated, so they can be looked up directly from
+ * a larger buffer without being copied, and may contain any bytes (including
+ * NUL). A string key and the same bytes given with their length are the same
+ * key, so the two forms can be mixed freely.
+ */
+bool map_contains_n(const map m, const char *key, size_t len);
+void map_set_n(map m, const char *key, size_t len, void *value);
+void **map_entry_n(map m, const char *key, size_t len, bool *inserted);
+void *map_get_n(const map m, const char *key, size_t len);
+bool map_try_get_n(const map m, const char *key, size_t len, void **value);
+void *map_remove_n(map m, const char *key, size_t len);
+bool map_try_remove_n(map m, const char *key, size_t len, void **value);
+
+/**
+ * Hash a key of `len` bytes for use with the `_hashed` functions.
+ * 
+ * The hash is keyed with a random seed shared by every map in the process
+ * (except maps created with `map_create_seeded`, which have their own), so
+ * computing it once saves rehashing the key for each map it is looked up in.
+ */
+map_hash_t map_hash_key(const char *key, size_t len);
+
+/**
+ * Variants of `map_get_n`, `map_try_get_n`, and `map_set_n` that take the
+ * key's hash, as computed by `map_hash_key`, instead of computing it again.
+ * 
+ * Maps created with `map_create_seeded` cannot use the precomputed hash, and
+ * instead hash the key themselves.
+ */
+void *map_get_hashed(const map m, const char *key, size_t len,
+    map_hash_t hash);
+bool map_try_get_hashed(const map m, const char *key, size_t len,
+    map_hash_t hash, void **value);
+void map_set_hashed(map m, const char *key, size_t len, map_hash_t hash,
+    void *value);
+
 /**
  * Iterate over a map's keys.
  * 
@@ -77,8 +361,64 @@ void *map_remove(map m, const char *key);
  * Note that the `key` passed to `map_next` must have come from a previous call
  * to `map_first` or `map_next`. Passing strings from other sources produces
  * undefined behavior.
+ * 
+ * Short keys are stored inside the map's table, so the returned keys are only
+ * valid until the map is next modified.
+ * 
+ * Keys are always followed by a NUL terminator, so keys added with the `_n`
+ * functions can be read as strings as long as they contain no NUL bytes.
+ * 
+ * Maps that borrow their keys (see `struct map_config`) instead return the
+ * caller's keys as they were given, which `map_next` measures with `strlen`.
+ * Such maps can only use `map_next` with NUL-terminated keys free of embedded
+ * NULs; iterators work with any keys.
  */
 const char *map_first(map m);
 const char *map_next(map m, const char *key);
 
+/**
+ * An iterator over a map's keys, created with `map_iter_start`.
+ * 
+ * Its fields are private to the map implementation, and are only declared here
+ * so that iterators can live on the stack.
+ */
+typedef struct map_iter {
+  map m;
+  int table;
+  size_t slot;
+} map_iter;
+
+/**
+ * Start iterating over a map's keys.
+ * 
+ * Usage:
+ * 
+ * map_iter it = map_iter_start(m);
+ * for (const char *key; (key = map_iter_next(&it)) != NULL;) {
+ *   ...
+ * }
+ * 
+ * Unlike `map_next`, which has to look up the previous key to find where it
+ * left off, an iterator remembers its position, so visiting every key costs
+ * little more than a scan over the map's memory. The map must not be modified
+ * while it is being iterated over.
+ */
+map_iter map_iter_start(map m);
+
+/**
+ * Get the next key from an iterator, or NULL if every key has been visited.
+ */
+const char *map_iter_next(map_iter *it);
+
+/**
+ * Get the next entry from an iterator, storing its key, the key's length, and
+ * its value in `*key`, `*len`, and `*value`. Returns false, without storing
+ * anything, if every entry has been visited.
+ * 
+ * This fetches the value along with the key, so no lookup is needed to find
+ * it. `len` and `value` may be NULL if not needed.
+ */
+bool map_iter_next_entry(map_iter *it, const char **key, size_t *len,
+    void **value);
+
 #endif
@@ -0,0 +1,493 @@
+// The tests check their results with `assert`, so they must keep it even in
+// builds that otherwise turn it off.
+#undef NDEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// The tests include the implementation itself, so that they can place keys in
+// chosen slots and inspect the tables directly.
+#include "map.c"
+
+/**
+ * Tests for the map implementation.
+ *
+ * Usage: ./map-test
+ *
+ * Checks every operation against a simple model of the map's contents, under
+ * each kind of map a config can create, and checks long probe runs, which are
+ * otherwise rare enough to go untested. Also checks that custom allocators see
+ * every allocation with the right sizes, that the compact layout keeps
+ * insertion order, and that shrinking gives memory back. `make test` runs
+ * these under each table engine and layout. Failures abort with an assertion.
+ */
+
+// Number of distinct keys the randomized tests draw from.
+#define NUM_KEYS 4000
+
+// Keys, and their lengths, shared by the randomized tests. Some are stored
+// inline and some in cells, and some contain NUL bytes.
+static char keys[NUM_KEYS][40];
+static size_t lens[NUM_KEYS];
+
+// The values each key should currently map to, and whether it is present.
+static void *expected[NUM_KEYS];
+static bool present[NUM_KEYS];
+
+/**
+ * Get the next number from a fixed xorshift sequence, so that every run
+ * performs the same operations.
+ */
+static uint64_t next_random() {
+  static uint64_t state = 88172645463325252ull;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+/**
+ * Fill `keys` with distinct keys of between 1 and 36 bytes. Every tenth key
+ * has a NUL byte in the middle.
+ */
+static void make_keys() {
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    int len = snprintf(keys[i], sizeof keys[i], "%d-", i);
+    int target = len + (int) (next_random() % 32);
+    while (len < target) {
+      keys[i][len++] = 'a' + next_random() % 26;
+    }
+    if (i % 10 == 0) keys[i][len / 2 + 1] = '\0';
+    keys[i][len] = '\0';
+    lens[i] = len;
+  }
+}
+
+/**
+ * Check that a map holds exactly the keys and values in the model, by looking
+ * each one up and by iterating. With `next`, also iterate with `map_first` and
+ * `map_next`, which maps that borrow keys only support for keys without NULs.
+ */
+static void check(map m, bool next) {
+  int size = 0;
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    void *value;
+    bool found = map_try_get_n(m, keys[i], lens[i], &value);
+    assert(found == present[i]);
+    assert(!found || value == expected[i]);
+    size += present[i];
+  }
+  assert(map_size(m) == size);
+
+  int seen = 0;
+  map_iter it = map_iter_start(m);
+  const char *key;
+  size_t len;
+  void *value;
+  while (map_iter_next_entry(&it, &key, &len, &value)) {
+    void *found;
+    assert(map_try_get_n(m, key, len, &found) && found == value);
+    seen += 1;
+  }
+  assert(seen == size);
+
+  if (next) {
+    seen = 0;
+    for (key = map_first(m); key != NULL; key = map_next(m, key)) {
+      seen += 1;
+    }
+    assert(seen == size);
+  }
+}
+
+/**
+ * Apply a random mix of insertions, updates, removals, lookups, and explicit
+ * resizes to a map, checking it against the model as it goes, then empty it.
+ */
+static void test_churn(map m, bool next, int rounds) {
+  memset(present, 0, sizeof present);
+  for (int r = 0; r < rounds; r += 1) {
+    int i = next_random() % NUM_KEYS;
+    int op = next_random() % 10;
+    if (op < 5) {
+      expected[i] = (void *) (uintptr_t) (next_random() | 1);
+      if (op % 2 == 0) {
+        map_set_n(m, keys[i], lens[i], expected[i]);
+      } else {
+        bool inserted;
+        *map_entry_n(m, keys[i], lens[i], &inserted) = expected[i];
+        assert(inserted == !present[i]);
+      }
+      present[i] = true;
+    } else if (op < 8) {
+      void *value;
+      bool found = map_try_remove_n(m, keys[i], lens[i], &value);
+      assert(found == present[i]);
+      assert(!found || value == expected[i]);
+      present[i] = false;
+    } else if (op == 8) {
+      assert(map_contains_n(m, keys[i], lens[i]) == present[i]);
+    } else if (next_random() % 100 == 0) {
+      map_shrink_to_fit(m);
+    } else if (next_random() % 100 == 0) {
+      map_reserve(m, next_random() % (2 * NUM_KEYS));
+    }
+    if (r % 5000 == 0) check(m, next);
+  }
+  check(m, next);
+
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    if (present[i]) map_remove_n(m, keys[i], lens[i]);
+    present[i] = false;
+  }
+  check(m, next);
+  map_shrink_to_fit(m);
+  check(m, next);
+}
+
+/**
+ * Run `test_churn` on each kind of map: plain, incremental, seeded, at a range
+ * of maximum loads, sharing keys through a pool, and borrowing keys.
+ */
+static void test_configs() {
+  static const double loads[] = {0.125, 0.5, 0.95, 0.99};
+  for (int incremental = 0; incremental < 2; incremental += 1) {
+    map m = map_create();
+    map_set_incremental_resize(m, incremental);
+    test_churn(m, true, 200000);
+    map_destroy(m);
+
+    for (size_t l = 0; l < sizeof loads / sizeof loads[0]; l += 1) {
+      struct map_config config = {0};
+      config.max_load = loads[l];
+      config.incremental_resize = incremental;
+      m = map_create_with_config(&config);
+      test_churn(m, true, 50000);
+      map_destroy(m);
+    }
+
+    struct map_config config = {0};
+    config.incremental_resize = incremental;
+    config.pool = map_create_pool(NULL);
+    m = map_create_with_config(&config);
+    test_churn(m, true, 100000);
+    map_destroy(m);
+    map_destroy(config.pool);
+
+    config.pool = NULL;
+    config.borrow_keys = true;
+    m = map_create_with_config(&config);
+    test_churn(m, false, 100000);
+    map_destroy(m);
+  }
+
+  map m = map_create_seeded(42);
+  test_churn(m, true, 100000);
+  map_destroy(m);
+}
+
+/**
+ * Check the batch operations against their one-at-a-time equivalents.
+ */
+static void test_batch() {
+  const char *batch[NUM_KEYS];
+  void *values[NUM_KEYS];
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    batch[i] = keys[i];
+    values[i] = (void *) (uintptr_t) (i + 1);
+  }
+  map m = map_build(batch, lens, values, NUM_KEYS);
+  assert(map_size(m) == NUM_KEYS);
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    assert(map_get_n(m, keys[i], lens[i]) == values[i]);
+  }
+
+  // Keys with NULs in them are looked up by their prefix, which is absent.
+  void *found_values[NUM_KEYS];
+  bool found[NUM_KEYS];
+  map_get_batch(m, batch, NUM_KEYS, found_values, found);
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    bool whole = strlen(keys[i]) == lens[i];
+    assert(found[i] == whole);
+    assert(!whole || found_values[i] == values[i]);
+  }
+
+  // Setting the same keys again only updates them.
+  map_set_batch(m, batch, lens, found_values, NUM_KEYS);
+  assert(map_size(m) == NUM_KEYS);
+  map_destroy(m);
+}
+
+/**
+ * Check that hashes from `map_hash_key` work across maps, including seeded
+ * maps, which hash keys themselves.
+ */
+static void test_hashed() {
+  map a = map_create();
+  map b = map_create_seeded(7);
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    map_hash_t h = map_hash_key(keys[i], lens[i]);
+    map_set_hashed(a, keys[i], lens[i], h, (void *) 1);
+    map_set_hashed(b, keys[i], lens[i], h, (void *) 2);
+  }
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    map_hash_t h = map_hash_key(keys[i], lens[i]);
+    assert(map_get_hashed(a, keys[i], lens[i], h) == (void *) 1);
+    assert(map_get_n(b, keys[i], lens[i]) == (void *) 2);
+  }
+  map_destroy(a);
+  map_destroy(b);
+}
+
+/**
+ * Check a probe run far longer than usual, by adding keys that all belong in
+ * one of two adjacent slots. With Robin Hood hashing, this runs past the
+ * longest distance a control byte can record (see `CTRL_FAR`). The run is
+ * then thinned out by removals, refilled, and moved into a larger table, both
+ * at once and incrementally.
+ */
+static void test_long_run() {
+  enum { RUN = 400 };
+  for (int incremental = 0; incremental < 2; incremental += 1) {
+    map m = map_create_seeded(12345);
+    map_reserve(m, 2 * RUN);
+    map_set_incremental_resize(m, incremental);
+    size_t mask = m->table.capacity - 1;
+
+    static char run[RUN][24];
+    size_t run_lens[RUN];
+    int n = 0;
+    for (unsigned long i = 0; n < RUN; i += 1) {
+      char key[24];
+      size_t len = snprintf(key, sizeof key, "run-%lu", i);
+      if ((hash(m, key, len) & mask) < 2) {
+        memcpy(run[n], key, len + 1);
+        run_lens[n] = len;
+        n += 1;
+      }
+    }
+
+    for (int i = 0; i < RUN; i += 1) {
+      map_set_n(m, run[i], run_lens[i], (void *) (uintptr_t) (i + 1));
+    }
+#ifdef MAP_ROBIN_HOOD
+    bool far = false;
+    for (size_t i = 0; i < m->table.capacity; i += 1) {
+      far |= m->table.ctrl[i] == CTRL_FAR;
+    }
+    assert(far);
+#endif
+    for (int i = 0; i < RUN; i += 1) {
+      assert(map_get_n(m, run[i], run_lens[i]) == (void *) (uintptr_t) (i + 1));
+    }
+    assert(!map_contains(m, "run-absent"));
+
+    for (int i = 0; i < RUN; i += 2) {
+      map_remove_n(m, run[i], run_lens[i]);
+    }
+    for (int i = 0; i < RUN; i += 1) {
+      assert(map_contains_n(m, run[i], run_lens[i]) == (i % 2 == 1));
+    }
+    for (int i = 0; i < RUN; i += 2) {
+      map_set_n(m, run[i], run_lens[i], (void *) (uintptr_t) (i + 1));
+    }
+
+    // Grow the map, moving the run into a new table. With incremental
+    // resizing, check the run part of the way through the move as well.
+    char key[24];
+    for (int i = 0; i < 4 * RUN; i += 1) {
+      snprintf(key, sizeof key, "grow-%d", i);
+      map_set(m, key, NULL);
+      if (incremental && m->old.capacity > 0 && i % 16 == 0) {
+        for (int j = 0; j < RUN; j += 1) {
+          assert(map_contains_n(m, run[j], run_lens[j]));
+        }
+      }
+    }
+    for (int i = 0; i < RUN; i += 1) {
+      assert(map_get_n(m, run[i], run_lens[i]) == (void *) (uintptr_t) (i + 1));
+    }
+    assert(map_size(m) == 5 * RUN);
+    map_destroy(m);
+  }
+}
+
+// Bytes currently allocated through `checked_allocator`, and the number of
+// calls made to it.
+static size_t checked_bytes;
+static size_t checked_calls;
+
+// Each block from `checked_allocator` is preceded by a header recording its
+// size, so that every later call can be checked against it.
+#define CHECKED_HEADER sizeof (max_align_t)
+
+/**
+ * Allocation callbacks that check the sizes and context passed to them, and
+ * keep track of how much memory is allocated.
+ */
+static void *checked_alloc(void *ctx, size_t size) {
+  assert(ctx == &checked_calls);
+  char *block = malloc(CHECKED_HEADER + size);
+  assert(block != NULL);
+  *(size_t *) block = size;
+  checked_bytes += size;
+  checked_calls += 1;
+  return block + CHECKED_HEADER;
+}
+static void *checked_realloc(void *ctx, void *block, size_t old_size,
+    size_t new_size) {
+  assert(ctx == &checked_calls);
+  char *header = (char *) block - CHECKED_HEADER;
+  assert(*(size_t *) header == old_size);
+  header = realloc(header, CHECKED_HEADER + new_size);
+  assert(header != NULL);
+  *(size_t *) header = new_size;
+  checked_bytes += new_size - old_size;
+  checked_calls += 1;
+  return header + CHECKED_HEADER;
+}
+static void checked_free(void *ctx, void *block, size_t size) {
+  assert(ctx == &checked_calls);
+  char *header = (char *) block - CHECKED_HEADER;
+  assert(*(size_t *) header == size);
+  checked_bytes -= size;
+  checked_calls += 1;
+  free(header);
+}
+static const struct map_allocator checked_allocator = {
+  checked_alloc, checked_realloc, checked_free, &checked_calls,
+};
+
+/**
+ * Check that maps, including pools and maps using them, get all of their
+ * memory from a custom allocator, pass it the right sizes, and give all of it
+ * back when destroyed.
+ */
+static void test_allocator() {
+  map m = map_create_with_allocator(&checked_allocator);
+  test_churn(m, true, 50000);
+  assert(checked_bytes > 0);
+  map_destroy(m);
+  assert(checked_bytes == 0);
+
+  struct map_config config = {0};
+  config.allocator = &checked_allocator;
+  config.incremental_resize = true;
+  config.pool = map_create_pool(&config);
+  m = map_create_with_config(&config);
+  test_churn(m, true, 50000);
+  map_destroy(m);
+  map_destroy(config.pool);
+  assert(checked_bytes == 0);
+  assert(checked_calls > 0);
+}
+
+#ifdef MAP_COMPACT
+/**
+ * Check that iterating a map visits the keys `order[0]` to `order[n - 1]`,
+ * which are indices into `keys`, in that order.
+ */
+static void check_order(map m, const int *order, int n) {
+  map_iter it = map_iter_start(m);
+  const char *key;
+  size_t len;
+  for (int j = 0; j < n; j += 1) {
+    assert(map_iter_next_entry(&it, &key, &len, NULL));
+    assert(len == lens[order[j]] && memcmp(key, keys[order[j]], len) == 0);
+  }
+  assert(!map_iter_next_entry(&it, &key, &len, NULL));
+}
+
+/**
+ * Check that the compact layout iterates in insertion order through removals,
+ * reinsertions, updates, and rebuilds of its index.
+ */
+static void test_order() {
+  enum { N = 1000 };
+  static int order[3 * N];
+  int n = 0;
+  map m = map_create();
+  for (int i = 0; i < N; i += 1) {
+    map_set_n(m, keys[i], lens[i], NULL);
+    order[n++] = i;
+  }
+  check_order(m, order, n);
+
+  // Removed keys drop out without disturbing the rest.
+  n = 0;
+  for (int i = 0; i < N; i += 1) {
+    if (i % 3 == 0) {
+      map_remove_n(m, keys[i], lens[i]);
+    } else {
+      order[n++] = i;
+    }
+  }
+  check_order(m, order, n);
+
+  // Keys added back go to the end, while updated keys stay in place.
+  for (int i = 0; i < N; i += 6) {
+    map_set_n(m, keys[i], lens[i], NULL);
+    order[n++] = i;
+  }
+  for (int i = 1; i < N; i += 3) {
+    map_set_n(m, keys[i], lens[i], (void *) 1);
+  }
+  check_order(m, order, n);
+
+  // Rebuilding squeezes out the holes, at the same size and when growing.
+  map_shrink_to_fit(m);
+  check_order(m, order, n);
+  for (int i = N; i < 3 * N; i += 1) {
+    map_set_n(m, keys[i], lens[i], NULL);
+    order[n++] = i;
+  }
+  check_order(m, order, n);
+  map_destroy(m);
+}
+#endif
+
+/**
+ * Check that a map shrinks on its own once removals leave it mostly empty, and
+ * that `map_shrink_to_fit` then shrinks its table to the smallest capacity
+ * that fits and gives back the memory of the removed keys' cells.
+ */
+static void test_shrink() {
+  map m = map_create();
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    map_set_n(m, keys[i], lens[i], (void *) (uintptr_t) (i + 1));
+  }
+  size_t full = m->table.capacity;
+  for (int i = 10; i < NUM_KEYS; i += 1) {
+    map_remove_n(m, keys[i], lens[i]);
+  }
+  assert(m->table.capacity < full / 8);
+
+  size_t held = m->cells.held;
+  map_shrink_to_fit(m);
+  assert(m->table.capacity == capacity_for(m, 10));
+  assert(m->table.deleted == 0);
+  assert(m->cells.held < held / 8);
+  for (int i = 0; i < NUM_KEYS; i += 1) {
+    void *value = (void *) (uintptr_t) (i + 1);
+    assert(map_contains_n(m, keys[i], lens[i]) == (i < 10));
+    assert(i >= 10 || map_get_n(m, keys[i], lens[i]) == value);
+  }
+  map_destroy(m);
+}
+
+int main() {
+  make_keys();
+  test_configs();
+  test_batch();
+  test_hashed();
+  test_long_run();
+  test_allocator();
+#ifdef MAP_COMPACT
+  test_order();
+#endif
+  test_shrink();
+  printf("ok\n");
+  return 0;
+}